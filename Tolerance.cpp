@@ -2,6 +2,10 @@
 #include "llvm/IR/Function.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/IR/IRBuilder.h"
@@ -12,25 +16,99 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Value.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Linker/IRMover.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 #include <llvm/Support/CommandLine.h>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "tolerance"
+
+STATISTIC(NumFunctions, "Number of functions protected");
+STATISTIC(NumCheckPoints, "Number of checkpoints found");
+STATISTIC(NumChecks, "Number of fault checks inserted");
+STATISTIC(NumRecoverySlots, "Number of recovery slots created");
+STATISTIC(NumRecovered, "Number of values read back through recovery");
+STATISTIC(NumAddedInsts, "Number of instructions added");
+
 static cl::opt<bool>
     CheckTRUMP("check-TRUMP", cl::Optional, cl::init(false),
-    cl::desc("Using TRUMP to check"));
+    cl::desc("Carry integers as AN-encoded shadows (TRUMP) instead of vector lanes"));
+static cl::opt<unsigned>
+    TRUMPConstant("tolerance-an-constant", cl::Optional, cl::init(3),
+    cl::desc("Odd multiplier A of the -check-TRUMP AN code"));
 static cl::opt<bool>
     CheckMajority("check-majority", cl::Optional, cl::init(false),
-    cl::desc("Using Majority to check"));
+    cl::desc("Recover by majority vote over the scalar and its shadow lanes"));
+static cl::opt<bool>
+    SSAShadow("tolerance-ssa-shadows", cl::Optional, cl::init(false),
+    cl::desc("Keep shadow vectors in SSA registers instead of vector allocas"));
+static cl::opt<unsigned>
+    VectorWidth("tolerance-vector-width", cl::Optional, cl::init(0),
+    cl::desc("Shadow vector width in bits (0 = widest target vector register)"));
+static cl::opt<bool>
+    PackOps("tolerance-pack-ops", cl::Optional, cl::init(false),
+    cl::desc("Pack pairs of independent isomorphic ops into one shadow vector"));
+static cl::opt<bool>
+    BatchChecks("tolerance-batch-checks", cl::Optional, cl::init(false),
+    cl::desc("Check all protected stores of a region with one branch"));
+static cl::opt<unsigned>
+    OverheadBudget("tolerance-budget", cl::Optional, cl::init(0),
+    cl::desc("Dynamic overhead budget in percent; protect the checkpoints with the most coverage per cost within it (0 = protect all)"));
+static cl::opt<std::string>
+    PolicyFile("tolerance-policy", cl::Optional, cl::init(""),
+    cl::desc("File of '<function glob> <policy>' lines setting per-function protection"));
+static cl::opt<bool>
+    LoopAware("tolerance-loop-aware", cl::Optional, cl::init(false),
+    cl::desc("Hoist invariant splats, check reductions at loop exits and induction steps by recomputation"));
+static cl::opt<unsigned>
+    CloneBudget("tolerance-clone-budget", cl::Optional, cl::init(0),
+    cl::desc("Code growth in percent allowed for shadow-aware clones of hot callees under -passes=tolerance-module (0 = no clones)"));
+static cl::opt<bool>
+    FaultCounters("tolerance-fault-counters", cl::Optional, cl::init(false),
+    cl::desc("Count faults per check and thread on the cold paths, for runtime/tolerance_rt.c"));
+static cl::opt<bool>
+    ControlFlowCheck("tolerance-control-flow", cl::Optional, cl::init(false),
+    cl::desc("Check compares feeding branches and selects lane-wise, and block transitions by signature"));
+static cl::opt<unsigned>
+    Threads("tolerance-threads", cl::Optional, cl::init(1),
+    cl::desc("Threads protecting functions under -passes=tolerance-module (0 = all cores)"));
 
 namespace {
-  typedef std::map<Value*, Value*> VectorizeMapTable;
-  std::vector<Value*> All_check, Real_check;
-  int recovery_alloca=0;
-  int recovery_inst=0;
-  int recovery_check=0;
-  int recovery_num=0;
+  typedef DenseMap<Value*, Value*> VectorizeMapTable;
  
 /**===================VectorizeMap========================**/
   class VectorizeMap {
@@ -68,1211 +146,2664 @@ namespace {
     VectorizeMapTable::iterator GetEnd() {
         return vmap.end();
     }
-    int GetSize(){
+    unsigned GetSize(){
         return vmap.size();
     }
-    void DeleteVal(Value *op){
-        vmap.erase(op);
-    }
   };
-  void PrintMap(VectorizeMap *map) {
-        errs() <<"(size = "<<map->GetSize()<<")\n";
-        VectorizeMapTable::iterator iter;
-        for(iter = map->GetBegin();iter!=map->GetEnd();iter++){
-            Value* v_sca=iter->first;
-            Value* v_vec=iter->second;
-            errs() << *v_sca << ":" << *v_vec << "\n";
-        }
+
+  //copies of a ty value in a shadow vector of bits: 4 x i32/float and
+  //2 x double at 128 bits, 4 x double and 4 x i64 with AVX2
+  unsigned GetLanes(unsigned bits, Type *ty){
+    unsigned size = ty->getPrimitiveSizeInBits();
+    if (size == 0)
+        return 4;
+    return std::max(2u, std::min(16u, bits/size));
   }
- 
 
-  Value* CreateSIMDInst(IRBuilder<> builder,Value* load,Type *op_type,char* str){
-    Value* val;
-    //unsigned size = op_type->getPrimitiveSizeInBits();
-    //errs()<<"Integer size:"<<size<<"\n";
-    if(op_type->isDoubleTy()){
-        val = UndefValue::get(VectorType::get(op_type, 2));
-        for (unsigned i = 0; i < 2; i++)//for 4 copies
-        {
-            val = builder.CreateInsertElement(val,load, builder.getInt32(i),str);  
-        }
-    }else if (op_type->isIntegerTy()||op_type->isFloatTy()){
-        val = UndefValue::get(VectorType::get(op_type, 4));
-        for (unsigned i = 0; i < 4; i++)//for 4 copies
-        {
-            val = builder.CreateInsertElement(val,load, builder.getInt32(i),str);  
-        }
-    }else {
+  //Check and recovery state of one protected store.
+  struct CheckSite {
+    Value *FaultCheck;   //i1, true when a shadow lane differs from the scalar
+    Value *Lanes;        //shadow vector holding the copies, or the AN code word
+    unsigned Base;       //first lane of this value's copies
+    unsigned Copies;     //number of copies from Base on
+    Value *Protected;    //scalar binop result that is stored
+    AllocaInst *Recovery;//slot the store finally reads its value from
+    bool Recompute;      //Lanes is a recomputed scalar, voted on with a third
+  };
+
+  //All shadow state of one function, passed by reference through the pass.
+  struct ShadowTable {
+    //bits of one shadow vector, sets how many copies each value gets
+    unsigned VectorBits;
+    //scalar alloca -> vector alloca, binop, cast or call -> vector op
+    VectorizeMap Shadow;
+    //vector forms of library calls, NULL if unknown
+    const TargetLibraryInfo *TLI;
+    //per-check remarks for -pass-remarks-output
+    OptimizationRemarkEmitter *ORE;
+    //allocas whose vector alloca already holds a vector op result
+    SmallPtrSet<Value*, 16> Stored;
+    //protected stores and returns, in discovery order
+    MapVector<Instruction*, CheckSite> Checks;
+    //packed op -> the op sharing its shadow vector
+    DenseMap<Value*, Value*> PackPartner;
+    //first op of a packed pair -> its operand shadows, until the second op
+    DenseMap<Value*, std::pair<Value*, Value*> > PackOperands;
+    //AN code multiplier and its inverse mod 2^64, 0 unless -check-TRUMP
+    uint64_t ANConstant;
+    uint64_t ANInverse;
+    //counters, for reporting
+    unsigned RecoveryAllocas, RecoveryChecks, RecoveryNum;
+    //-tolerance-budget: only the selected checkpoints, binops and slots
+    //are shadowed
+    bool Selective;
+    SmallPtrSet<Value*, 32> Selected;
+    //checks call __tolerance_fault instead of recovering
+    bool DetectOnly;
+    //-tolerance-control-flow: compares, switch conditions and block
+    //transitions are checked too
+    bool ControlFlow;
+    //name of the function, as passed to __tolerance_fault
+    Constant *FaultFuncName;
+    //source files of the -tolerance-fault-counters site descriptors, and
+    //the number of descriptors so far
+    StringMap<Constant*> SiteFiles;
+    unsigned SiteDescs;
+    //-tolerance-loop-aware: reduction checkpoint -> exit block its check
+    //sinks to, reduction slot -> its loop, induction step -> its store,
+    //and the (slot, loop) splats already built in a preheader
+    MapVector<StoreInst*, BasicBlock*> Reductions;
+    DenseMap<Value*, Loop*> ReductionSlots;
+    DenseMap<Value*, StoreInst*> IVSteps;
+    DenseSet<std::pair<Value*, Loop*> > Hoisted;
+    //PHIs whose shadow PHI still lacks its incoming shadows
+    std::vector<PHINode*> Phis;
+    //calls to shadow-aware clones, with their number of scalar arguments,
+    //whose argument shadows are still placeholders; in a clone, the slot
+    //its result shadow goes to
+    std::vector<std::pair<CallInst*, unsigned> > ShadowCalls;
+    Argument *RetShadow;
+
+    ShadowTable(): VectorBits(128), TLI(NULL), ORE(NULL), ANConstant(0), ANInverse(0),
+        RecoveryAllocas(0), RecoveryChecks(0), RecoveryNum(0),
+        Selective(false), DetectOnly(false), ControlFlow(false), FaultFuncName(NULL),
+        SiteDescs(0), RetShadow(NULL) {}
+    bool IsSelected(Value *val) const {
+        return !Selective || Selected.count(val);
+    }
+    //-check-TRUMP carries integers of up to 32 bits as A*x in 64 bits, so
+    //a code word only wraps after the value has grown by 2^32/A
+    bool IsANType(Type *ty) const {
+        return ANConstant && ty->isIntegerTy() &&
+               ty->getIntegerBitWidth() >= 8 && ty->getIntegerBitWidth() <= 32;
+    }
+    unsigned GetLanes(Type *ty) const {
+        return ::GetLanes(VectorBits, ty);
+    }
+  };
+
+  Value* CreateSIMDInst(IRBuilder<> &builder,Value* load,Type *op_type,unsigned lanes,const char* str){
+    if(!(op_type->isIntegerTy()||op_type->isFloatTy()||op_type->isDoubleTy())){
          errs()<<"Cannot Create this SIMD type"<<*op_type<<"\n";
+         return NULL;
     }
-    return val;
+    //one insertelement + one shufflevector, lowered to a single broadcast
+    //(vbroadcastss/vpbroadcastd, or from memory when load is a load)
+    return builder.CreateVectorSplat(lanes,load,str);
+  }
+  bool IsShadowType(Type *ty){
+    return ty->isIntegerTy() || ty->isFloatTy() || ty->isDoubleTy();
+  }
+  //val has a shadow of its own, or one can be computed from the shadows
+  //of its operands, rather than only a splat of val.
+  bool HasShadow(Value *val, ShadowTable &ST){
+    if (ST.Shadow.IsAdded(val))
+        return true;
+    if (LoadInst *ld = dyn_cast<LoadInst>(val))
+        return ST.Shadow.IsAdded(ld->getPointerOperand());
+    if (CastInst *op = dyn_cast<CastInst>(val))
+        return IsShadowType(op->getSrcTy()) && HasShadow(op->getOperand(0), ST);
+    if (CallInst *op = dyn_cast<CallInst>(val))
+        for (Value *arg : op->arg_operands())
+            if (HasShadow(arg, ST))
+                return true;
+    return false;
+  }
+  Value* GetVecOpValue(IRBuilder<> &builder,Value* val,ShadowTable &ST,Type *op_type);
+  Value *GetANOpValue(IRBuilder<> &builder, Value *val, ShadowTable &ST);
+  Value *CreateANDecode(IRBuilder<> &builder, Value *enc, Type *ty, ShadowTable &ST);
+
+  //Shadow of val as lanes, also where ST carries it as an AN code word.
+  Value *GetLaneShadow(IRBuilder<> &builder, Value *val, ShadowTable &ST){
+    Type *ty = val->getType();
+    if (ST.IsANType(ty))
+        return CreateSIMDInst(builder, CreateANDecode(builder, GetANOpValue(builder, val, ST), ty, ST),
+                              ty, ST.GetLanes(ty), "insertDecode");
+    return GetVecOpValue(builder, val, ST, ty);
   }
-  Value* GetVecOpValue(IRBuilder<> builder,Value* val,VectorizeMap vec_map,Type *op_type){
+
+  //Vector cast of the source shadow: sext, zext, fptosi, sitofp, ... lane
+  //by lane. Lane counts differ with the type size (i32 -> double), so the
+  //source lanes are cut or repeated to fit. AN sources are decoded first.
+  Value *CreateShadowCast(IRBuilder<> &builder, CastInst *op, ShadowTable &ST){
+    Type *src_ty = op->getSrcTy(), *dst_ty = op->getDestTy();
+    if (!IsShadowType(src_ty) || !IsShadowType(dst_ty))
+        return NULL;
+    Value *vsrc = GetLaneShadow(builder, op->getOperand(0), ST);
+    if (!vsrc)
+        return NULL;
+    unsigned src_lanes = ST.GetLanes(src_ty), lanes = ST.GetLanes(dst_ty);
+    if (src_lanes != lanes) {
+        SmallVector<uint32_t, 16> Mask;
+        for (unsigned i = 0; i < lanes; i++)
+            Mask.push_back(i % src_lanes);
+        vsrc = builder.CreateShuffleVector(vsrc, UndefValue::get(vsrc->getType()), Mask, "fitLanes");
+    }
+    return builder.CreateCast(op->getOpcode(), vsrc, VectorType::get(dst_ty, lanes), "Vcast");
+  }
+
+  //Calls with a vector form are redone on the argument shadows: trivially
+  //vectorizable intrinsics (sqrt, fabs, fma, ...) as their vector
+  //intrinsic, pure libm calls through the vector library TLI maps them to.
+  //NULL if the call has none.
+  Value *CreateShadowCall(IRBuilder<> &builder, CallInst *op, ShadowTable &ST){
+    Type *ty = op->getType();
+    if (!IsShadowType(ty))
+        return NULL;
+    unsigned lanes = ST.GetLanes(ty);
+    Type *vec_ty = VectorType::get(ty, lanes);
+    Function *callee = op->getCalledFunction();
+    Intrinsic::ID id = getVectorIntrinsicIDForCall(op, ST.TLI);
+    bool intrinsic = id != Intrinsic::not_intrinsic && isTriviallyVectorizable(id);
+    if (!intrinsic && !(callee && ST.TLI && op->doesNotAccessMemory() &&
+                        ST.TLI->isFunctionVectorizable(callee->getName(), lanes)))
+        return NULL;
+    //every vector operand must fit the lanes of the result
+    for (unsigned i = 0; i < op->getNumArgOperands(); i++)
+        if (!(intrinsic && hasVectorInstrinsicScalarOpd(id, i)) && op->getArgOperand(i)->getType() != ty)
+            return NULL;
+    SmallVector<Value*, 4> Args;
+    SmallVector<Type*, 4> ArgTys;
+    for (unsigned i = 0; i < op->getNumArgOperands(); i++) {
+        Value *arg = op->getArgOperand(i);
+        if (intrinsic && hasVectorInstrinsicScalarOpd(id, i))
+            Args.push_back(arg);
+        else
+            Args.push_back(GetVecOpValue(builder, arg, ST, ty));
+        if (!Args.back())
+            return NULL;
+        ArgTys.push_back(Args.back()->getType());
+    }
+    Module *M = op->getModule();
+    Value *vfn;
+    if (intrinsic)
+        vfn = Intrinsic::getDeclaration(M, id, vec_ty);
+    else
+        vfn = M->getOrInsertFunction(ST.TLI->getVectorizedFunction(callee->getName(), lanes),
+                                     FunctionType::get(vec_ty, ArgTys, false));
+    CallInst *vcall = builder.CreateCall(vfn, Args, "Vcall");
+    vcall->copyFastMathFlags(op);
+    return vcall;
+  }
+
+  Value* GetVecOpValue(IRBuilder<> &builder,Value* val,ShadowTable &ST,Type *op_type){
     if(isa<LoadInst>(val)){//find add inst and 2 op is load, do SIMD "add"
         //errs()<< "****GetVecOpValue Load!\n";
         LoadInst* ld_inst = cast<LoadInst>(val);//value to loadinst
         Value* sca = ld_inst->getPointerOperand();
         //errs()<<"sca:"<<*sca<<"\n";
-        Value *alloca_vec = vec_map.GetVector(sca);
+        Value *alloca_vec = ST.Shadow.GetVector(sca);
+        //loads through GEPs and pointers have no shadow memory: the loaded
+        //value is the shadow, splat where it is used
+        if(!alloca_vec)
+            return CreateSIMDInst(builder,val,val->getType(),ST.GetLanes(val->getType()),"insertLoad");
         //errs()<<"get vector:"<<*alloca_vec<<"\n";
         //create load before "add"
         LoadInst* load_val=builder.CreateLoad(alloca_vec);
         load_val->setAlignment(16);
         return load_val;
-    }else if(isa<BinaryOperator>(val)){
-        //errs()<< "****GetVecOpValue BinaryOperator:\n";
-        BinaryOperator* bin_inst=cast<BinaryOperator>(val);
-        //errs()<<"bin_inst:"<<*bin_inst<<"\n";
-        Value *bin_vec = vec_map.GetVector(bin_inst);
-        //errs()<<"get vector:"<<*bin_vec<<"\n";
-        return bin_vec;
+    }else if(ST.Shadow.IsAdded(val)){
+        //binops and PHIs that already have a shadow
+        return ST.Shadow.GetVector(val);
     }else if(isa<Constant>(val)){
           
         Constant* c = dyn_cast<Constant>(val);
-        if(op_type->isDoubleTy()){
-            return ConstantVector::getSplat(2, c);
-        }else if(op_type->isIntegerTy()||op_type->isFloatTy()){
-            return ConstantVector::getSplat(4, c);
+        if(op_type->isIntegerTy()||op_type->isFloatTy()||op_type->isDoubleTy()){
+            return ConstantVector::getSplat(ST.GetLanes(op_type), c);
         }else {  
             errs()<<"Not support this Constant val:"<<*val<<"\n";
         }
         
         
-    }else if(isa<CallInst>(val)){
-        //errs()<< "Find Call Inst: "<<*val <<"\n";
-        Value* CallInst = vec_map.GetVector(val);
-        Value* CallInstVec= vec_map.GetVector(CallInst);
-        //errs()<< "Alloca: "<<*CallInst <<"\n";
-        //errs()<< "Vector: "<<*CallInstVec <<"\n";
-
-        auto store_c = builder.CreateStore(val,CallInst);
-        auto load_c = builder.CreateLoad(CallInst);
-        load_c->setAlignment(4);
-        Type* inst_ty= val->getType();
-
-
-        Value* val_c = CreateSIMDInst(builder,load_c,inst_ty,"insertCall");
-
-        auto store_val=builder.CreateStore(val_c,CallInstVec);
-        store_val->setAlignment(4);
-        auto load_val=builder.CreateLoad(CallInstVec);
-        load_val->setAlignment(4);
-        return load_val;
-       
-    }else if(isa<CastInst>(val)){
-        //errs()<< "Find Cast Inst: "<<*val <<"\n";
-        Value* CastInst = vec_map.GetVector(val);
-        Value* CastInstVec= vec_map.GetVector(CastInst);
-        //errs()<< "Alloca: "<<*CastInst <<"\n";
-        //errs()<< "Vector: "<<*CastInstVec <<"\n";
-
-        auto store_c = builder.CreateStore(val,CastInst);
-        auto load_c = builder.CreateLoad(CastInst);
-        load_c->setAlignment(4);
-        Type* inst_ty= val->getType();
-        Value* val_c = CreateSIMDInst(builder,load_c,inst_ty,"insertCast");
-       
-        auto store_val=builder.CreateStore(val_c,CastInstVec);
-        store_val->setAlignment(4);
-        auto load_val=builder.CreateLoad(CastInstVec);
-        load_val->setAlignment(4);
-        return load_val;
-       
+    }else if(isa<CallInst>(val) || isa<CastInst>(val)){
+        //redo the cast or call on the shadows of its operands, once, right
+        //after it; a splat of the result when it has no vector form
+        Value *vec = NULL;
+        if (HasShadow(val, ST)) {
+            IRBuilder<> builderafter(cast<Instruction>(val)->getNextNode());
+            if (CastInst *op = dyn_cast<CastInst>(val))
+                vec = CreateShadowCast(builderafter, op, ST);
+            else
+                vec = CreateShadowCall(builderafter, cast<CallInst>(val), ST);
+        }
+        if (vec) {
+            ST.Shadow.AddPair(val, vec);
+            return vec;
+        }
+        return CreateSIMDInst(builder,val,val->getType(),ST.GetLanes(val->getType()),isa<CastInst>(val) ? "insertCast" : "insertCall");
+    }else if(op_type->isIntegerTy()||op_type->isFloatTy()||op_type->isDoubleTy()){
+        //arguments, binops left unshadowed and other SSA values: splat at the use
+        return CreateSIMDInst(builder,val,val->getType(),ST.GetLanes(val->getType()),"insertVal");
     }else {
         errs()<< "####return else: Transforms Not Support Type: "<<*val <<"\n";
         return NULL;
         }
       return NULL;
   }
-  void InsertCheck(Function &F,VectorizeMap check_map, VectorizeMap recovery_map1, VectorizeMap recovery_map){
-    for(int i =0 ; i<recovery_map1.GetSize(); i++){
-        //errs()<<"Recovery Map:\n";
-         //PrintMap(&recovery_map);
-        
-         //errs()<<"Start Insert Check!\n";
-         
-            bool check_flag=0;
-            for (auto &B : F) {
-                //errs()<<"----------\n";
-                //B.dump();
-               // errs()<<"----------\n";
-                for (auto &I : B) {
-                    //insert check before store
-                    //I.dump();
-                    if (StoreInst *op = dyn_cast<StoreInst>(&I)) {
-                       //errs()<<"FFF:"<<*op<<"\n";
-                       if(recovery_map.IsAdded(op)){
-                            
-                            //errs()<<"Insert check!\n";
-                            //errs()<<"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@"<<*op<<"\n";
-                             
-                            
-                          
-                            IRBuilder<> builder(op);
-                            Value *fault_check = check_map.GetVector(op);
-                            Value *recovery = recovery_map1.GetVector(op);
-                            //errs()<<"OP:"<<*op<<"\n";
-                            //errs()<<"fault_check"<<*fault_check<<"\n";  
-                            Value *ex0 = check_map.GetVector(fault_check);
-                            Instruction* faultinst=cast<Instruction>(fault_check);
-                            Value* lhs = faultinst->getOperand(0);
-                            Value* rhs = faultinst->getOperand(1);
-                            Value *recovery_val = recovery_map.GetVector(op);
-
-                            //BinaryOperator* op_inst= cast<BinaryOperator>(recovery_val);
-                            Type* op_type =recovery_val ->getType();
-                         
-                            //before:
-                            //  Head
-                            //  op
-                            //  Tail
-                            //after:
-                            //  Head
-                            //  if(fault_check)
-                            //      checkTerm
-                            //  op
-                            //  Tail
-                            TerminatorInst* checkTerm = SplitBlockAndInsertIfThen(fault_check, op,false);
-                   
-                          
-                            IRBuilder<> builderCheck(checkTerm);
-                            //Taking mul_three value div by ex0, because only Interger can use Rem operator.
-                            //Inter use SDIV, Float use FDIV.
-                       
-                            //#4
-                            Value *mod_three,*mul_value,*cmp_three;
-                            if(op_type->isIntegerTy()){
-                                 
-                                mod_three = builderCheck.CreateSDiv(lhs,ex0,"remThree");
-                                
-                                Instruction* ty= cast<Instruction>(mod_three);
-                                mul_value = ConstantInt::get(ty->getType() , 3);
-                               
-                                //errs()<<"mod_three:"<<*mod_three<<"\n";   
-                                //errs()<<"mul_value :"<<*mul_value <<"\n";   
-                                //cmp div ex0 = 3
-                              
-                                cmp_three = builderCheck.CreateICmpNE(mod_three,mul_value,"FcmpThree");
-                            }else if(op_type->isFloatTy()){
-                                
-                                mod_three = builderCheck.CreateFDiv(lhs,ex0,"remThree");
-                                
-                                Instruction* ty= cast<Instruction>(mod_three);
-                                mul_value = ConstantFP::get(ty->getType() , 3);
-                               
-                                //errs()<<"Fmod_three:"<<*mod_three<<"\n";   
-                                //errs()<<"Fmul_value :"<<*mul_value <<"\n";   
-                                //cmp div ex0 = 3
-                              
-                                cmp_three = builderCheck.CreateFCmpUNE(mod_three,mul_value,"FcmpThree");
-                                //errs()<<"Fcmp :"<<*cmp_three <<"\n"; 
-                            }else if(op_type->isDoubleTy()){
-                                
-                                mod_three = builderCheck.CreateFDiv(lhs,ex0,"remThree");
-                                
-                                Instruction* ty= cast<Instruction>(mod_three);
-                                mul_value = ConstantFP::get(ty->getType() , 3);
-                               
-                                //errs()<<"Fmod_three:"<<*mod_three<<"\n";   
-                                //errs()<<"Fmul_value :"<<*mul_value <<"\n";   
-                                //cmp div ex0 = 3
-                              
-                                cmp_three = builderCheck.CreateFCmpUNE(mod_three,mul_value,"FcmpThree");
-                                //errs()<<"Fcmp :"<<*cmp_three <<"\n"; 
-                            }else {
-                                errs()<<"####4 Not Support Operator Type:"<<*op_type<<"\n";
-                            }
-                            //}
-                            //for ( BasicBlock::iterator i = checkTerm->begin(), e = checkTerm->end();i!= e; ++i)
-                            //errs()<<"end"<<*checkTerm<<"\n";   
-                            //Then = div 3 can recovery
-                            unsigned size = op_type->getPrimitiveSizeInBits();
-                           
-                            TerminatorInst *ThenTerm , *ElseTerm ;
-
-                            SplitBlockAndInsertIfThenElse(cmp_three, checkTerm, &ThenTerm, &ElseTerm,nullptr);
-                            IRBuilder<> builderRecovery(ThenTerm);
-                            auto* store_recovery=builderRecovery.CreateStore(recovery_val,recovery);
-                            store_recovery->setAlignment(size/8);
-                            //Else = original i
-                            IRBuilder<> builderRecoveryElse(ElseTerm);                           
-                            
-                            auto* store_recoveryElse=builderRecoveryElse.CreateStore(ex0,recovery);
-                            store_recoveryElse->setAlignment(size/8);
-                            
-                            check_flag=1;
-                            Real_check.push_back(op);
-                            recovery_check++;
-                            //errs()<<"Delete Map!\n";
-                            recovery_map.DeleteVal(op);
-                            ////user->setOperand(U.getOperandNo(), mul);//final store
-                           
-                        }//if end
-                    }//find store end
-                    
-                    if(check_flag) break;
-                    }//Basciblock
-                    
-                if(check_flag) break;
-            }//Function
-      }
-}
-void Test(){
-    errs()<<"@@@@@@@@@@@Majority\n";
-}
-void InsertMajority(Function &F,VectorizeMap check_map, VectorizeMap recovery_map1, VectorizeMap recovery_map){
-    for(int i =0 ; i<recovery_map1.GetSize(); i++){
-        //errs()<<"Recovery Map:\n";
-         //PrintMap(&recovery_map);
-        
-         //errs()<<"Start Insert Check!\n";
-         
-            bool check_flag=0;
-            for (auto &B : F) {
-                //errs()<<"----------\n";
-                //B.dump();
-               // errs()<<"----------\n";
-                for (auto &I : B) {
-                    //insert check before store
-                    //I.dump();
-                    if (StoreInst *op = dyn_cast<StoreInst>(&I)) {
-                       //errs()<<"FFF:"<<*op<<"\n";
-                       if(recovery_map.IsAdded(op)){
-                            
-                            //errs()<<"Insert check!\n";
-                            //errs()<<"@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@"<<*op<<"\n";
-                             
-                            
-                          
-                            IRBuilder<> builder(op);
-                            Value *fault_check = check_map.GetVector(op);
-                            Value *recovery = recovery_map1.GetVector(op);
-                            //errs()<<"OP:"<<*op<<"\n";
-                            //errs()<<"fault_check"<<*fault_check<<"\n";  
-                            Value *ex0 = check_map.GetVector(fault_check);
-                            Instruction* faultinst=cast<Instruction>(fault_check);
-                            Value* lhs = faultinst->getOperand(0);//protected value
-                            Value* rhs = faultinst->getOperand(1);//memory address
-                            Value *recovery_val = recovery_map.GetVector(op);
-
-                            //BinaryOperator* op_inst= cast<BinaryOperator>(recovery_val);
-                            Type* op_type =recovery_val ->getType();
-                         
-                            //before:
-                            //  Head
-                            //  op
-                            //  Tail
-                            //after:
-                            //  Head
-                            //  if(fault_check)
-                            //      checkTerm
-                            //  op
-                            //  Tail
-                            TerminatorInst* checkTerm = SplitBlockAndInsertIfThen(fault_check, op,false);
-                   
-                          
-                            IRBuilder<> builderCheck(checkTerm);
-                            //Taking mul_three value div by ex0, because only Interger can use Rem operator.
-                            //Inter use SDIV, Float use FDIV.
-                       
-                            //#4
-                            Value *mod_three,*mul_value,*cmp_three;
-                            if(op_type->isIntegerTy()){
-                                 
-                                mod_three = builderCheck.CreateSDiv(lhs,ex0,"remThree");
-                                
-                                Instruction* ty= cast<Instruction>(mod_three);
-                                mul_value = ConstantInt::get(ty->getType() , 3);
-                               
-                                //errs()<<"mod_three:"<<*mod_three<<"\n";   
-                                //errs()<<"mul_value :"<<*mul_value <<"\n";   
-                                //cmp div ex0 = 3
-                              
-                                cmp_three = builderCheck.CreateICmpNE(mod_three,mul_value,"FcmpThree");
-                            }else if(op_type->isFloatTy()){
-                                
-                                mod_three = builderCheck.CreateFDiv(lhs,ex0,"remThree");
-                                
-                                Instruction* ty= cast<Instruction>(mod_three);
-                                mul_value = ConstantFP::get(ty->getType() , 3);
-                               
-                                //errs()<<"Fmod_three:"<<*mod_three<<"\n";   
-                                //errs()<<"Fmul_value :"<<*mul_value <<"\n";   
-                                //cmp div ex0 = 3
-                              
-                                cmp_three = builderCheck.CreateFCmpUNE(mod_three,mul_value,"FcmpThree");
-                                //errs()<<"Fcmp :"<<*cmp_three <<"\n"; 
-                            }else if(op_type->isDoubleTy()){
-                                
-                                mod_three = builderCheck.CreateFDiv(lhs,ex0,"remThree");
-                                
-                                Instruction* ty= cast<Instruction>(mod_three);
-                                mul_value = ConstantFP::get(ty->getType() , 3);
-                               
-                                //errs()<<"Fmod_three:"<<*mod_three<<"\n";   
-                                //errs()<<"Fmul_value :"<<*mul_value <<"\n";   
-                                //cmp div ex0 = 3
-                              
-                                cmp_three = builderCheck.CreateFCmpUNE(mod_three,mul_value,"FcmpThree");
-                                //errs()<<"Fcmp :"<<*cmp_three <<"\n"; 
-                            }else {
-                                errs()<<"####4 Not Support Operator Type:"<<*op_type<<"\n";
-                            }
-                            //}
-                            //for ( BasicBlock::iterator i = checkTerm->begin(), e = checkTerm->end();i!= e; ++i)
-                            //errs()<<"end"<<*checkTerm<<"\n";   
-                            //Then = div 3 can recovery
-                            unsigned size = op_type->getPrimitiveSizeInBits();
-                           
-                            TerminatorInst *ThenTerm , *ElseTerm ;
-
-                            SplitBlockAndInsertIfThenElse(cmp_three, checkTerm, &ThenTerm, &ElseTerm,nullptr);
-                            IRBuilder<> builderRecovery(ThenTerm);
-                            auto* store_recovery=builderRecovery.CreateStore(recovery_val,recovery);
-                            store_recovery->setAlignment(size/8);
-                            //Else = original i
-                            IRBuilder<> builderRecoveryElse(ElseTerm);                           
-                            
-                            auto* store_recoveryElse=builderRecoveryElse.CreateStore(ex0,recovery);
-                            store_recoveryElse->setAlignment(size/8);
-                            
-                            check_flag=1;
-                            Real_check.push_back(op);
-                            recovery_check++;
-                            //errs()<<"Delete Map!\n";
-                            recovery_map.DeleteVal(op);
-                            ////user->setOperand(U.getOperandNo(), mul);//final store
-                           
-                        }//if end
-                    }//find store end
-                    
-                    if(check_flag) break;
-                    }//Basciblock
-                    
-                if(check_flag) break;
-            }//Function
-      }
-}
-  void ReplaceRecoveryVal(Function &F, VectorizeMap r_map){
+  //Inverse of an odd A mod 2^64, by Newton iteration: A*A = 1 mod 8, and
+  //each step doubles the correct low bits.
+  uint64_t GetANInverse(uint64_t A){
+    uint64_t inv = A;
+    for (int i = 0; i < 5; i++)
+        inv *= 2 - A * inv;
+    return inv;
+  }
+  //A*sext(val), the AN code word of val
+  Value *CreateANEncode(IRBuilder<> &builder, Value *val, ShadowTable &ST){
+    Value *wide = builder.CreateSExt(val, builder.getInt64Ty());
+    return builder.CreateMul(wide, builder.getInt64(ST.ANConstant), "encode");
+  }
+  //one multiply by the inverse of A; exact even if the code word wrapped
+  Value *CreateANDecode(IRBuilder<> &builder, Value *enc, Type *ty, ShadowTable &ST){
+    Value *val = builder.CreateMul(enc, builder.getInt64(ST.ANInverse));
+    return builder.CreateTrunc(val, ty, "decode");
+  }
+  //Code word of a binop operand: the shadow slot of a load, the shadow of a
+  //binop, else val encoded where it is used.
+  Value *GetANOpValue(IRBuilder<> &builder, Value *val, ShadowTable &ST){
+    if (LoadInst *ld_inst = dyn_cast<LoadInst>(val)) {
+        Value *slot = ST.Shadow.GetVector(ld_inst->getPointerOperand());
+        if (slot) {
+            LoadInst *load_val = builder.CreateLoad(slot);
+            load_val->setAlignment(8);
+            return load_val;
+        }
+    } else if (Value *enc = ST.Shadow.GetVector(val)) {
+        return enc;
+    }
+    return CreateANEncode(builder, val, ST);
+  }
+
+  //iN mask of the lanes base..base+copies-1 where vec differs from expect.
+  //One lane-wise compare, with the <N x i1> result bitcast to an integer.
+  //FP lanes are compared as integers: exact, and a NaN result matches its
+  //copies.
+  Value *CreateLaneMask(IRBuilder<> &builder, Value *vec, Value *expect, unsigned base, unsigned copies){
+    VectorType *vec_ty = cast<VectorType>(vec->getType());
+    unsigned lanes = vec_ty->getNumElements();
+    Type *elt_ty = vec_ty->getElementType();
+    if (!elt_ty->isIntegerTy()) {
+        Type *int_ty = VectorType::get(builder.getIntNTy(elt_ty->getPrimitiveSizeInBits()), lanes);
+        vec = builder.CreateBitCast(vec, int_ty);
+        expect = builder.CreateBitCast(expect, int_ty);
+    }
+    Value *lane_ne = builder.CreateICmpNE(vec, expect, "laneNE");
+    Value *mask = builder.CreateBitCast(lane_ne, builder.getIntNTy(lanes), "laneMask");
+    if (base != 0 || copies != lanes)
+        mask = builder.CreateAnd(mask, ConstantInt::get(mask->getType(), APInt::getBitsSet(lanes, base, base+copies)));
+    return mask;
+  }
+
+  //i1 that is true when any copy differs from expect; the mask test lowers
+  //to movmsk/ptest on x86.
+  Value *CreateAnyMismatch(IRBuilder<> &builder, Value *vec, Value *expect, unsigned base, unsigned copies){
+    Value *mask = CreateLaneMask(builder, vec, expect, base, copies);
+    return builder.CreateICmpNE(mask, ConstantInt::get(mask->getType(), 0), "Fcmp");
+  }
+
+  //Picks the value to store once a fault is detected.
+  typedef Value *(*RecoveryFn)(IRBuilder<> &builder, CheckSite &site);
+
+  //TRUMP style: the first copy when all copies agree with it, i.e. the
+  //scalar was hit, else the scalar itself.
+  Value *CreateRecoveryValue(IRBuilder<> &builder, CheckSite &site){
+    Value *ex0 = builder.CreateExtractElement(site.Lanes, (uint64_t)site.Base, "extractE");
+    unsigned lanes = cast<VectorType>(site.Lanes->getType())->getNumElements();
+    Value *splat = builder.CreateVectorSplat(lanes, ex0);
+    Value *lanes_split = CreateAnyMismatch(builder, site.Lanes, splat, site.Base, site.Copies);
+    return builder.CreateSelect(lanes_split, site.Protected, ex0, "Recovered");
+  }
+
+  //Majority vote over the scalar and its copies, without branches. The
+  //scalar wins with a majority of the votes; failing that the first copy
+  //does, else the second copy (a single upset hits one voter only).
+  Value *CreateMajorityValue(IRBuilder<> &builder, CheckSite &site){
+    Value *vec = site.Lanes;
+    Value *scalar = site.Protected;
+    unsigned lanes = cast<VectorType>(vec->getType())->getNumElements();
+    unsigned voters = site.Copies + 1;
+    Value *ex0 = builder.CreateExtractElement(vec, (uint64_t)site.Base, "extractE");
+    Value *ex1 = builder.CreateExtractElement(vec, (uint64_t)site.Base+1, "extractE");
+    Value *ne_scalar = CreateLaneMask(builder, vec, builder.CreateVectorSplat(lanes, scalar), site.Base, site.Copies);
+    Value *ne_ex0 = CreateLaneMask(builder, vec, builder.CreateVectorSplat(lanes, ex0), site.Base, site.Copies);
+    Type *mask_ty = ne_scalar->getType();
+    Function *ctpop = Intrinsic::getDeclaration(builder.GetInsertBlock()->getModule(), Intrinsic::ctpop, mask_ty);
+    Constant *all = ConstantInt::get(mask_ty, voters);
+    Constant *majority = ConstantInt::get(mask_ty, voters/2 + 1);
+    //votes = voters - voters that differ; the scalar votes for ex0 when
+    //the first copy's bit of ne_scalar is clear
+    Value *votes_scalar = builder.CreateSub(all, builder.CreateCall(ctpop, {ne_scalar}), "votes");
+    Value *ex0_ne_scalar = builder.CreateAnd(builder.CreateLShr(ne_scalar, site.Base), 1);
+    Value *votes_ex0 = builder.CreateSub(builder.CreateSub(all, builder.CreateCall(ctpop, {ne_ex0})), ex0_ne_scalar, "votes");
+    Value *copy = builder.CreateSelect(builder.CreateICmpUGE(votes_ex0, majority), ex0, ex1, "Vote");
+    return builder.CreateSelect(builder.CreateICmpUGE(votes_scalar, majority), scalar, copy, "Majority");
+  }
+
+  //TRUMP recovery: a code word that is still a multiple of A was not hit
+  //(no single bit flip is), so the scalar was and the decoded word wins.
+  Value *CreateANRecoveryValue(IRBuilder<> &builder, ShadowTable &ST, CheckSite &site){
+    Constant *A = builder.getInt64(ST.ANConstant);
+    Value *valid = builder.CreateICmpEQ(builder.CreateSRem(site.Lanes, A), builder.getInt64(0), "codeWord");
+    Value *dec = builder.CreateTrunc(builder.CreateSDiv(site.Lanes, A), site.Protected->getType(), "decode");
+    return builder.CreateSelect(valid, dec, site.Protected, "Recovered");
+  }
+  //Copy of an integer the optimizer cannot see through: an empty asm that
+  //returns its operand in a register.
+  Value *CreateOpaqueCopy(IRBuilder<> &builder, Value *val, const Twine &name){
+    FunctionType *copy_ty = FunctionType::get(val->getType(), {val->getType()}, false);
+    return builder.CreateCall(InlineAsm::get(copy_ty, "", "=r,0", false), {val}, name);
+  }
+
+  //A recomputed step that disagrees with op is settled by a third
+  //computation: op is kept if that one agrees with it, else the recomputed
+  //step wins. Keeping op in the vote also keeps -O2 from folding the
+  //recovery, and with it the check, into the recomputed step.
+  Value *CreateRecomputeVote(IRBuilder<> &builder, CheckSite &site){
+    BinaryOperator *op = cast<BinaryOperator>(site.Protected);
+    Value *iv = CreateOpaqueCopy(builder, op->getOperand(0), "ivVoteCopy");
+    Value *third = CreateOpaqueCopy(builder,
+                                    builder.CreateBinOp(op->getOpcode(), iv, op->getOperand(1), "ivVote"), "ivVoteStep");
+    return builder.CreateSelect(builder.CreateICmpEQ(third, op), op, site.Lanes, "Recovered");
+  }
+  Value *RecoverSite(IRBuilder<> &builder, ShadowTable &ST, CheckSite &site, RecoveryFn recover){
+    if (site.Recompute)
+        return CreateRecomputeVote(builder, site);
+    //AN sites have no lanes to vote over
+    if (!site.Lanes->getType()->isVectorTy())
+        return CreateANRecoveryValue(builder, ST, site);
+    return recover(builder, site);
+  }
+
+  //A runtime hook. Only a declaration created here is marked cold and
+  //noinline; one the module brings keeps its attributes, so the result
+  //does not depend on which function declared the hook first.
+  Constant *GetHook(Module *M, StringRef name, FunctionType *FTy){
+    if (M->getFunction(name))
+        return M->getOrInsertFunction(name, FTy);
+    Function *hook_fn = Function::Create(FTy, GlobalValue::ExternalLinkage, name, M);
+    hook_fn->addFnAttr(Attribute::Cold);
+    hook_fn->addFnAttr(Attribute::NoInline);
+    return hook_fn;
+  }
+  //The globals made for a function are named after it, never by the
+  //module's uniquing counter, so they get the same names whichever
+  //functions were protected before; see ProtectInParts.
+  Constant *GetFaultFuncName(IRBuilder<> &builder, ShadowTable &ST){
+    StringRef fn = builder.GetInsertBlock()->getParent()->getName();
+    if (!ST.FaultFuncName)
+        ST.FaultFuncName = cast<Constant>(builder.CreateGlobalStringPtr(fn, "tolerance.func." + fn));
+    return ST.FaultFuncName;
+  }
+
+  //Detect-only: report the fault to the runtime hook
+  //  void __tolerance_fault(const char *function, int site);
+  //site is the index of the check in the function. The hook may abort,
+  //log and return, or restart; when it returns the store goes ahead.
+  void CreateFaultCall(IRBuilder<> &builder, ShadowTable &ST, Value *site){
+    Module *M = builder.GetInsertBlock()->getModule();
+    Constant *hook = GetHook(M, "__tolerance_fault", FunctionType::get(builder.getVoidTy(),
+                             {builder.getInt8PtrTy(), builder.getInt32Ty()}, false));
+    GetFaultFuncName(builder, ST);
+    CallInst *call = builder.CreateCall(hook, {ST.FaultFuncName, site});
+    call->addAttribute(AttributeList::FunctionIndex, Attribute::Cold);
+  }
+  //-tolerance-fault-counters: the cold path of a check also calls
+  //  void __tolerance_count(struct tolerance_site *site);
+  //of runtime/tolerance_rt.c with a descriptor of the check,
+  //  {i32 id, i32 line, i32 column, i32 site, i8 *function, i8 *file},
+  //located at the debug location of at. id is 0 until the runtime
+  //registers the site. With cond, the site is counted only when it holds.
+  void CreateCountCall(IRBuilder<> &builder, ShadowTable &ST, Instruction *at, int site, Value *cond = NULL){
+    if (!FaultCounters)
+        return;
+    Module *M = builder.GetInsertBlock()->getModule();
+    StringRef fn = builder.GetInsertBlock()->getParent()->getName();
+    GetFaultFuncName(builder, ST);
+    unsigned line = 0, column = 0;
+    StringRef file;
+    if (DILocation *Loc = at->getDebugLoc().get()) {
+        line = Loc->getLine();
+        column = Loc->getColumn();
+        file = Loc->getFilename();
+    }
+    Constant *&file_str = ST.SiteFiles[file];
+    if (!file_str)
+        file_str = cast<Constant>(builder.CreateGlobalStringPtr(file, "tolerance.file." + fn + "." + Twine(ST.SiteFiles.size())));
+    StructType *site_ty = StructType::get(builder.getInt32Ty(), builder.getInt32Ty(), builder.getInt32Ty(),
+                                          builder.getInt32Ty(), builder.getInt8PtrTy(), builder.getInt8PtrTy());
+    Constant *init = ConstantStruct::get(site_ty, {builder.getInt32(0), builder.getInt32(line), builder.getInt32(column),
+                                                   builder.getInt32(site), ST.FaultFuncName, file_str});
+    //written by the runtime, so not constant
+    GlobalVariable *desc = new GlobalVariable(*M, site_ty, false, GlobalValue::PrivateLinkage, init,
+                                              "tolerance.site." + fn + "." + Twine(ST.SiteDescs++));
+    Constant *hook = GetHook(M, "__tolerance_count", FunctionType::get(builder.getVoidTy(), {builder.getInt8PtrTy()}, false));
+    Value *arg = ConstantExpr::getBitCast(desc, builder.getInt8PtrTy());
+    if (cond)
+        arg = builder.CreateSelect(cond, arg, ConstantPointerNull::get(builder.getInt8PtrTy()));
+    CallInst *call = builder.CreateCall(hook, {arg});
+    call->addAttribute(AttributeList::FunctionIndex, Attribute::Cold);
+  }
+  int SiteIndex(ShadowTable &ST, Instruction *op){
+    return ST.Checks.find(op) - ST.Checks.begin();
+  }
+
+  //One small cold block per check, holding only the hook call.
+  void InsertDetect(ShadowTable &ST){
+    Function *F = ST.Checks.front().first->getFunction();
+    MDNode *Unlikely = MDBuilder(F->getContext()).createBranchWeights(1, 1 << 20);
+    unsigned site = 0;
+    for (auto &Site : ST.Checks) {
+        Instruction *op = Site.first;
+        TerminatorInst* faultTerm = SplitBlockAndInsertIfThen(Site.second.FaultCheck, op, false, Unlikely);
+        IRBuilder<> builderFault(faultTerm);
+        CreateCountCall(builderFault, ST, op, site);
+        CreateFaultCall(builderFault, ST, builderFault.getInt32(site++));
+        ST.RecoveryChecks++;
+    }
+  }
+
+  //A check without a Recovery slot, on a value that leaves through a return
+  //or, in SSA form, a store: the recovered value meets the original in a
+  //PHI that op then uses.
+  void InsertValueRecovery(ShadowTable &ST, Instruction *op, CheckSite &site, RecoveryFn recover){
+    MDNode *Unlikely = MDBuilder(op->getContext()).createBranchWeights(1, 1 << 20);
+    BasicBlock *head = op->getParent();
+    TerminatorInst *checkTerm = SplitBlockAndInsertIfThen(site.FaultCheck, op, false, Unlikely);
+    IRBuilder<> builderCheck(checkTerm);
+    CreateCountCall(builderCheck, ST, op, SiteIndex(ST, op));
+    Value *fixed = RecoverSite(builderCheck, ST, site, recover);
+    PHINode *phi = PHINode::Create(site.Protected->getType(), 2, "Recovered", &op->getParent()->front());
+    phi->addIncoming(site.Protected, head);
+    phi->addIncoming(fixed, checkTerm->getParent());
+    op->setOperand(0, phi);
+    ST.RecoveryChecks++;
+  }
+
+  //Before every protected store, branch on its check to a block that
+  //stores the recovered value to the Recovery slot the store reads.
+  //ST.Checks keeps the protected stores in discovery order, so each one is
+  //visited exactly once; splitting its block never touches the list.
+  void InsertRecovery(ShadowTable &ST, RecoveryFn recover){
+    if (ST.DetectOnly) {
+        if (!ST.Checks.empty())
+            InsertDetect(ST);
+        return;
+    }
+    for (auto &Site : ST.Checks) {
+        Instruction *op = Site.first;
+        if (!Site.second.Recovery) {
+            InsertValueRecovery(ST, op, Site.second, recover);
+            continue;
+        }
+        Type* op_type = Site.second.Protected->getType();
+        unsigned size = op_type->getPrimitiveSizeInBits();
+
+        //before:
+        //  Head
+        //  op
+        //  Tail
+        //after:
+        //  Head
+        //  if(fault_check)
+        //      checkTerm: Recovery = recovered value
+        //  op
+        //  Tail
+        TerminatorInst* checkTerm = SplitBlockAndInsertIfThen(Site.second.FaultCheck, op,false);
+        IRBuilder<> builderCheck(checkTerm);
+        CreateCountCall(builderCheck, ST, op, SiteIndex(ST, op));
+        Value *fixed = RecoverSite(builderCheck, ST, Site.second, recover);
+        auto* store_recovery=builderCheck.CreateStore(fixed,Site.second.Recovery);
+        store_recovery->setAlignment(size/8);
+
+        ST.RecoveryChecks++;
+    }
+  }
+  void InsertCheck(ShadowTable &ST){
+    InsertRecovery(ST, CreateRecoveryValue);
+  }
+  void InsertMajority(ShadowTable &ST){
+    InsertRecovery(ST, CreateMajorityValue);
+  }
+
+  //A protected store can wait for the batched check past inst, unless inst
+  //may observe or overwrite one of the region's slots, or ends the block.
+  bool IsBatchBarrier(Instruction *inst, const SmallPtrSetImpl<Value*> &slots){
+    if (inst->isTerminator())
+        return true;
+    Value *ptr = NULL;
+    if (LoadInst *ld = dyn_cast<LoadInst>(inst))
+        ptr = ld->getPointerOperand();
+    else if (StoreInst *st = dyn_cast<StoreInst>(inst))
+        ptr = st->getPointerOperand();
+    //distinct allocas never alias
+    if (ptr && isa<AllocaInst>(ptr) && !slots.count(ptr))
+        return false;
+    return inst->mayReadOrWriteMemory();
+  }
+
+  //Batched checks: the Fcmp results of all protected stores of a region are
+  //ORed together and tested by one well-predicted branch at the end of the
+  //region. The cold path rewrites every slot of the region with its voted
+  //value, as recover picks it.
+  void InsertBatchedChecks(Function &F, ShadowTable &ST, RecoveryFn recover){
+    //regions: runs of protected stores in one block, closed by a barrier
+    std::vector<std::pair<std::vector<StoreInst*>, Instruction*> > Regions;
     for (auto &B : F) {
-        //B.dump();
+        std::vector<StoreInst*> region;
+        SmallPtrSet<Value*, 8> slots;
         for (auto &I : B) {
-            //insert check before store
-            if (StoreInst *op = dyn_cast<StoreInst>(&I)) {
-                if(r_map.IsAdded(op)){
-                    Value *recovery = r_map.GetVector(op);
-                    IRBuilder<> builder(op);
-                    auto* load_recovery=builder.CreateLoad(recovery,"ReplaceInst");
-            
-                    auto *rhs = cast<AllocaInst>(op->getOperand(1));
-                    Type* op_type = rhs->getAllocatedType();
-                    unsigned size = op_type->getPrimitiveSizeInBits();
-                    //errs() << "####op_type: " << *op_type << "\n";
-                    //errs() << "####size: " << size << "\n";
-                    load_recovery->setAlignment(size/8);
-                    op->setOperand(0, load_recovery);
-                    recovery_num++;
-                }
+            StoreInst *st = dyn_cast<StoreInst>(&I);
+            if (st && ST.Checks.count(&I)) {
+                region.push_back(st);
+                slots.insert(st->getPointerOperand());
+            } else if (!region.empty() && IsBatchBarrier(&I, slots)) {
+                Regions.push_back(std::make_pair(region, &I));
+                region.clear();
+                slots.clear();
             }
         }
     }
+    MDNode *Unlikely = MDBuilder(F.getContext()).createBranchWeights(1, 1 << 20);
+    for (auto &Region : Regions) {
+        IRBuilder<> builder(Region.second);
+        Value *any_fault = NULL;
+        for (StoreInst *op : Region.first) {
+            Value *fault_check = ST.Checks[op].FaultCheck;
+            any_fault = any_fault ? builder.CreateOr(any_fault, fault_check, "anyFault") : fault_check;
+        }
+        TerminatorInst *coldTerm = SplitBlockAndInsertIfThen(any_fault, Region.second, false, Unlikely);
+        IRBuilder<> builderCold(coldTerm);
+        //count each faulty site of the region
+        for (StoreInst *op : Region.first)
+            CreateCountCall(builderCold, ST, op, SiteIndex(ST, op),
+                            Region.first.size() > 1 ? ST.Checks[op].FaultCheck : NULL);
+        if (ST.DetectOnly) {
+            //report the first faulty site of the region
+            Value *site = NULL;
+            for (auto it = Region.first.rbegin(); it != Region.first.rend(); ++it) {
+                Constant *index = builderCold.getInt32(ST.Checks.find(*it) - ST.Checks.begin());
+                site = site ? builderCold.CreateSelect(ST.Checks[*it].FaultCheck, index, site) : index;
+            }
+            CreateFaultCall(builderCold, ST, site);
+        }
+        for (StoreInst *op : Region.first) {
+            ST.RecoveryChecks++;
+            if (ST.DetectOnly)
+                continue;
+            Value *fixed = RecoverSite(builderCold, ST, ST.Checks[op], recover);
+            builderCold.CreateStore(fixed, op->getPointerOperand());
+        }
+    }
+    //returns have nothing to batch with
+    for (auto Site = ST.Checks.begin(); Site != ST.Checks.end(); ++Site) {
+        Instruction *op = Site->first;
+        if (isa<StoreInst>(op))
+            continue;
+        if (!ST.DetectOnly) {
+            InsertValueRecovery(ST, op, Site->second, recover);
+            continue;
+        }
+        TerminatorInst *faultTerm = SplitBlockAndInsertIfThen(Site->second.FaultCheck, op, false, Unlikely);
+        IRBuilder<> builderFault(faultTerm);
+        CreateCountCall(builderFault, ST, op, SiteIndex(ST, op));
+        CreateFaultCall(builderFault, ST, builderFault.getInt32(SiteIndex(ST, op)));
+        ST.RecoveryChecks++;
+    }
+  }
+
+  void ReplaceRecoveryVal(ShadowTable &ST){
+    for (auto &Site : ST.Checks) {
+        Instruction *op = Site.first;
+        if (!Site.second.Recovery)
+            continue;//recovered through a PHI
+        IRBuilder<> builder(op);
+        auto* load_recovery=builder.CreateLoad(Site.second.Recovery,"ReplaceInst");
+
+        //the store may go through any pointer; the slot is aligned to the value
+        load_recovery->setAlignment(Site.second.Recovery->getAlignment());
+        op->setOperand(0, load_recovery);
+        ST.RecoveryNum++;
+    }
 }
 
-  struct TolerancePass : public FunctionPass {
-    static char ID;
-    TolerancePass() : FunctionPass(ID) {}
-    //int basic_num=0;
-    virtual bool runOnFunction(Function &F) {
-      errs() << "function name: " << F.getName() << "\n";
-      //errs() << "Function body:\n";
-      //F.dump();
-      VectorizeMap vec_map,check_map,recovery_map,recovery_map1,vec_stored_map;
-      std::vector<Value*> binop,loadbefore,CheckPoint, RecoveryPoint, Cast_op, Call_op;
-      static LLVMContext TheContext;
-      //bool allcheck=false;
-      //Dependence pass
-      for (auto &B : F) {
-       
+  //Promote the vector allocas and recovery slots created by the pass, so
+  //the shadow lanes live in vector registers with PHIs across blocks.
+  void PromoteShadows(Function &F, ShadowTable &ST, const std::vector<Value*> &RecoveryPoint){
+    SmallPtrSet<Value*, 32> Slots;
+    for (Value *slot : RecoveryPoint)
+        if (slot)
+            Slots.insert(slot);
+    for (auto iter = ST.Shadow.GetBegin(); iter != ST.Shadow.GetEnd(); iter++) {
+        if (isa<AllocaInst>(iter->second))
+            Slots.insert(iter->second);
+    }
+    //collect in program order, so the output does not depend on map order
+    std::vector<AllocaInst*> Allocas;
+    for (auto &B : F) {
         for (auto &I : B) {
-            if (auto *op = dyn_cast<BinaryOperator>(&I)) {
-                //handle castinst and callinst
-                Value* lhs = op->getOperand(0);
-                Value* rhs = op->getOperand(1);
-                //errs()<<"lhs:"<<*lhs<<"\n";
-                //errs()<<"rhs:"<<*rhs<<"\n";
-                //castinst
-                if(isa<CastInst>(lhs)){
-                    Cast_op.push_back(lhs);
-                }
-                if(isa<CastInst>(rhs)){
-                    Cast_op.push_back(rhs);
-                }
-                //callinst
-                if(isa<CallInst>(lhs)){
-                    Call_op.push_back(lhs);
-                }
-                if(isa<CallInst>(rhs)){
-                    Call_op.push_back(rhs);
-                }
+            AllocaInst *slot = dyn_cast<AllocaInst>(&I);
+            if (slot && Slots.count(slot) && isAllocaPromotable(slot))
+                Allocas.push_back(slot);
+        }
+    }
+    if (Allocas.empty())
+        return;
+    //checks split blocks, so build the tree on the final CFG
+    DominatorTree DT(F);
+    PromoteMemToReg(Allocas, DT);
+  }
 
-                //--------------------------------//
-                //add into array
-                binop.push_back(op);
-            }
-            else if (auto *op = dyn_cast<LoadInst>(&I)) {
-                //add into array(use before now op)
-                loadbefore.push_back(op);
-            }
-            else if (StoreInst *op = dyn_cast<StoreInst>(&I)) {
-                IRBuilder<> builder(op);
-                Value* lhs = op->getOperand(0);
-                Value* rhs = op->getOperand(1);
-                //()<<"*****Find Store:"<<*op<<"\n";
-                //errs()<<"lhs :"<<*lhs <<"\n";
-                //errs()<<"rhs:"<<*rhs<<"\n";
-                //left op is binop?
-                if(isa<BinaryOperator>(*lhs)){
-
-                    //if(allcheck){
-                    //   CheckPoint.push_back(op);
-                    //}else
-                    //{
-                        bool Pflag=false;
-                        //find right op uses (alloca inst)
-                        for (auto &U : rhs->uses()) {
-
-                           
-                            User *user = U.getUser(); 
-                            
-                        if(isa<LoadInst>(*user)){
-                            //errs()<<"=Find:"<<*user<<"\n";
-                            bool Cflag=true;
-                            for(int i=0; i<loadbefore.size(); i++){
-                            //if loadinst uses before?
-                                if(user==loadbefore[i]){//find load before = already used
-                                    Cflag=false;
-                                    //errs()<<"@FUCK:"<<*user<<"\n";
-                                }
-                             }
-                        //if find loadinst never use
-                        
-                            if(Cflag){
-                                //errs()<<"========\n";
-                                //errs()<<"BINOP map:\n";
-                                //check this load inst uses for binop
-                              for(int i=0; i<binop.size(); i++){
-                                 //errs()<<"binop:"<<*binop[i]<<"\n";
-                              
-                                //errs()<<"loadinst:"<<*user <<"\n";
-                                for (auto &U1 : user->uses()) {
-                                    User *user1 = U1.getUser(); 
-                                    //errs()<<"user1:"<<*user1 <<"\n";
-                                    
-                                    for(int i=0; i<binop.size(); i++){
-                                        if(isa<BinaryOperator>(*user1)){//Is use to do binop
-                                        //if binop uses before?
-                                            if(user1==binop[i]){
-                                                 //errs()<<"====load no uses op!====\n";
-                                                Pflag=true;
-                                            }else{
-                                                 //errs()<<"====load uses new op!====\n";
-                                                Pflag=false;
-                                                break;
-                                            }
-                                        }else{
-                                            Pflag=true;
-                                        }
-                                    }
-                                    }
-                                    if(!Pflag){
-                                        
-                                         break;
-                                    }
-
-                                }
-                                //break;//only find one load never use before
-                            }//Cflag end
-                                else {
-                                    //errs()<<"Only Find Load before\n";
-                                    //only find load before.. but it's useless
-                                    Pflag=true;
-                                }
-                                if(!Pflag){
-                                        
-                                    break;
-                                }
-
-                            }//find load end
-
-                            }
-                            if(Pflag){
-                                    //errs()<<"Find no binaryop uses load inst\n";
-                                    CheckPoint.push_back(op);
-                                    All_check.push_back(op);
-                                    //recovery_inst++;
-                                    //create recovery
-                                    //AllocaInst* recovery=builder.CreateAlloca(rhs->getType(),nullptr,"Recovery");
-                                    //recovery->setAlignment(4);
-
-                            }
-                        }//find sotre inst's left op is binop
-
-                    //}//allcheck else end
-                }//find store end
+/**===================CheckPointInfo========================**/
+  //A checkpoint is a store of a binop result whose slot is read again, but
+  //never by a load that feeds a binop not yet seen: the protected value
+  //leaves the redundant computation there, so it is checked before the store.
+  //Stores through GEPs and other pointers always are: memory has no shadow.
+  class CheckPointInfo {
+    StringRef FuncName;
+    std::vector<StoreInst*> CheckPoints;//in program order
+    DenseMap<StoreInst*, unsigned> Index;
+
+    public:
+    void analyze(Function &F) {
+        FuncName = F.getName();
+        CheckPoints.clear();
+        Index.clear();
+        DenseMap<Instruction*, unsigned> Position;
+        unsigned pos = 0;
+        for (auto &B : F)
+            for (auto &I : B)
+                Position[&I] = ++pos;
+        //per local slot, the last point a load of it still flows into a
+        //binop: both the load and the binop come after that point
+        DenseMap<Value*, unsigned> LastFlow;
+        for (auto &B : F) {
+            for (auto &I : B) {
+                LoadInst *ld = dyn_cast<LoadInst>(&I);
+                if (!ld || !isa<AllocaInst>(ld->getPointerOperand()))
+                    continue;
+                unsigned flow = 0;
+                for (User *user : ld->users())
+                    if (isa<BinaryOperator>(user))
+                        flow = std::max(flow, Position[cast<Instruction>(user)]);
+                unsigned &last = LastFlow[ld->getPointerOperand()];
+                last = std::max(last, std::min(flow, Position[ld]));
             }
         }
-      //errs()<<"*=*=*CheckPoint:\n";
-      bool Pflag=false;
-      //CREATE recovery allocation instruction
-      //AND castinst and callinst allocation
-      //for(int i=0; i<CheckPoint.size(); i++)
-      //   errs()<<"CheckPoint:"<<*CheckPoint[i]<<"\n";
-
-         for (auto &B : F) {
+        for (auto &B : F) {
             for (auto &I : B) {
-                if (auto *op = dyn_cast<AllocaInst>(&I)) {
-
-                    IRBuilder<> builder(op);
-                    for(int i=0; i<CheckPoint.size(); i++){
-                        //errs()<<"!!!!!!!!!!!!!!!!!"<<*CheckPoint[i]<<"\n";
-                        //Value* lhs = CheckPoint[i]->getOperand(0);
-                        
-                        Instruction* op1 = cast<Instruction>(CheckPoint[i]);
-                        Value* rhs = op1->getOperand(0);
-                        //errs()<<"rhs"<<*rhs<<"\n";
-                        AllocaInst* recovery=builder.CreateAlloca(rhs->getType(),nullptr,"Recovery");
-                        recovery_alloca++;
-                        Type* op_type = rhs->getType();
-                        unsigned size = op_type->getPrimitiveSizeInBits();
-                        recovery->setAlignment(size/8);
-                        //errs()<<"!!!!!!!!!!!!!!!!!"<<*recovery<<"\n";
-                        RecoveryPoint.push_back(recovery);
-                        Pflag=true;
-                    }
-                    //build castinst allocation inst
-                    for(int i=0; i<Cast_op.size(); i++){
-                        Instruction* vop = cast<Instruction>(Cast_op[i]);
-                        Type* op_type = vop->getType();
-                        AllocaInst* castinst=builder.CreateAlloca(op_type,nullptr,"CastInst");
-                       
-                        unsigned size = op_type->getPrimitiveSizeInBits();
-                        castinst->setAlignment(4);
-                        //errs()<<"!!!!!!!!!!!!!!!!!"<<*castinst<<"\n";
-                       
-                        AllocaInst* CastInstVec;
-                        if(op_type->isDoubleTy()){
-                            CastInstVec = builder.CreateAlloca(VectorType::get(op_type, 2),nullptr,"CastInstVec");
-                        }else if(op_type->isIntegerTy()||op_type->isFloatTy()){
-                            CastInstVec = builder.CreateAlloca(VectorType::get(op_type, 4),nullptr,"CastInstVec");
-                        }else{
-                            //errs()<<"Not support this size:"<<size<<"\n";
-                            CastInstVec = builder.CreateAlloca(VectorType::get(op_type, 4),nullptr,"CastInstVec");
-                            /*if(size==64){
-                                CastInstVec = builder.CreateAlloca(VectorType::get(op_type, 2),nullptr,"CastInstVec");
-                            }else {
-                                CastInstVec = builder.CreateAlloca(VectorType::get(op_type, 4),nullptr,"CastInstVec");
-                            }*/
-                            
-                        }
-                       
-                        CastInstVec->setAlignment(16);
-                        vec_map.AddPair(Cast_op[i],castinst);
-                        vec_map.AddPair(castinst,CastInstVec);
-                        Pflag=true;
-                    }
-                     //build callinst allocation inst
-                    for(int i=0; i<Call_op.size(); i++){
-                        Instruction* vop = cast<Instruction>(Call_op[i]);
-                        Type* op_type = vop->getType();
-                        AllocaInst* callinst=builder.CreateAlloca(op_type,nullptr,"CallInst");
-                        unsigned size = op_type->getPrimitiveSizeInBits();
-                        callinst->setAlignment(4);
-                        //errs()<<"!!!!!!!!!!!!!!!!!"<<*callinst<<"\n";
-                        
-                        AllocaInst* CallInstVec;
-                        if(op_type->isDoubleTy()){
-                            CallInstVec = builder.CreateAlloca(VectorType::get(op_type, 2),nullptr,"CallInstVec");
-                        }else if(op_type->isIntegerTy()||op_type->isFloatTy()){
-                            CallInstVec = builder.CreateAlloca(VectorType::get(op_type, 4),nullptr,"CallInstVec");
-                        }else{
-                            //errs()<<"Not support this size:"<<size<<"\n";
-                            CallInstVec = builder.CreateAlloca(VectorType::get(op_type, 4),nullptr,"CallInstVec");
-                            /*
-                            if(size==64){
-                                CallInstVec = builder.CreateAlloca(VectorType::get(op_type, 2),nullptr,"CallInstVec");
-                            }else {
-                                CallInstVec = builder.CreateAlloca(VectorType::get(op_type, 4),nullptr,"CallInstVec");
-                            }*/
-                            
-                        }
-                      
-                        CallInstVec->setAlignment(16);
-                        vec_map.AddPair(Call_op[i],callinst);
-                        vec_map.AddPair(callinst,CallInstVec);
-                        Pflag=true;
-                    }
+                StoreInst *op = dyn_cast<StoreInst>(&I);
+                //vectors and other values without a shadow are not checked
+                if (!op || !isa<BinaryOperator>(op->getValueOperand()) ||
+                    !IsShadowType(op->getValueOperand()->getType()))
+                    continue;
+                Value *ptr = op->getPointerOperand();
+                if (!isa<AllocaInst>(ptr) || IsFinalStore(ptr, Position[op], LastFlow)) {
+                    Index[op] = CheckPoints.size();
+                    CheckPoints.push_back(op);
                 }
-                if(Pflag)break;
-                                    
-            }
-            if(Pflag)break;
-         }
-      //tolerance
-      BasicBlock::iterator ignoreuntilinst;
-
-      for (auto &B : F) {
-        //errs() << "@@@@Basic block:";
-        //B.dump();
-        bool BuilderAfterflag=1;
-        for (auto &I : B) {
-        //BasicBlock* bb=I.getParent();
-        //Find allocation instruction
-            //I.dump();
-        if (BuilderAfterflag) {
-        if (auto *op = dyn_cast<AllocaInst>(&I)) {
-            //errs()<< "Tolerance:Find AllocaInst!\n";
-            
-            IRBuilder<> builder(op);
-            
-            Type* scalar_t= op->getAllocatedType();//not pointer
-            
-            //Type* scalar_t1= op->getType();//pointer
-            
-            //errs()<<*scalar_t1<<"\n";
-            //support inst type?
-            if(scalar_t->isIntegerTy()){//32bits --> [Integer,Integer,Integer,Integer]
-             
-                auto allocaVec = builder.CreateAlloca(VectorType::get(scalar_t, 4),nullptr,"allocaVec");
-                allocaVec->setAlignment(16);
-                //errs()<<"address sca:"<<*op<<",vec:"<<*allocaVec<<"\n";
-                vec_map.AddPair(op,allocaVec);
-               
-                //errs()<<"Find integer:"<<*scalar_t<<"\n";
-                
-                //get vector demo
-                auto *vec = vec_map.GetVector(op);
-                //errs()<< "Tolerance:Create AllocaInst VectorTy:"<<*vec<<"\n";
-                //errs()<<"get vector:"<<*vec<<"\n";
-            }  
-            else if(scalar_t->isFloatTy()){//32bits --> [Float,Float,Float,Float]
-                auto allocaVec = builder.CreateAlloca(VectorType::get(scalar_t, 4),nullptr,"allocaVec");
-                allocaVec->setAlignment(16);
-                //errs()<<"address sca:"<<*op<<",vec:"<<*allocaVec<<"\n";
-                vec_map.AddPair(op,allocaVec);
-                //get vector demo
-                auto *vec = vec_map.GetVector(op);
-                //errs()<< "Tolerance:Create FloatInst Vectorty:"<<*vec<<"\n";
-            }else if(scalar_t->isDoubleTy()){//64bits --> [Double,Double]
-                auto allocaVec = builder.CreateAlloca(VectorType::get(scalar_t, 2),nullptr,"allocaVec");
-                allocaVec->setAlignment(16);
-                //errs()<<"address sca:"<<*op<<",vec:"<<*allocaVec<<"\n";
-                vec_map.AddPair(op,allocaVec);
-                //get vector demo
-                auto *vec = vec_map.GetVector(op);
-                //errs()<< "Tolerance:Create FloatInst Vectorty:"<<*vec<<"\n";
             }
         }
-        else if (StoreInst *op = dyn_cast<StoreInst>(&I)) {//find store constant to allocainst and store same value to vector
-                IRBuilder<> builder(op);
-                Value* lhs = op->getOperand(0);
-                Value* rhs = op->getOperand(1);
-                //()<<"*****Find Store:"<<*op<<"\n";
-                
-                //left op is binop?
-                if(isa<Constant>(lhs)){
-                    if(vec_map.Findpair(rhs)){
-                        Value *vec = vec_map.GetVector(rhs);
-                        Constant* c = dyn_cast<Constant>(lhs);
-                        auto alloca_op=cast<AllocaInst>(rhs);
-                        Type* op_type = alloca_op->getAllocatedType();;
-                        /*errs()<<"lhs :"<<*lhs <<"\n";
-                        errs()<<"rhs:"<<*rhs<<"\n";
-                        errs()<<"op:"<<op_type->isIntegerTy()<<"\n";*/
-                        if(op_type->isDoubleTy()){
-                            Value *store_constant = builder.CreateStore(ConstantVector::getSplat(2, c),vec);
-                            //errs()<<"Constant Type:"<<*op_type<<"\n";
-                        }else if(op_type->isIntegerTy()||op_type->isFloatTy()){
-                            Value *store_constant = builder.CreateStore(ConstantVector::getSplat(4, c),vec);
-                            //errs()<<"Constant Type:"<<*op_type<<"\n";
-                        }else {  
-                            //errs()<<"Not support this Constant Type:"<<*op_type<<"\n";
-                            errs()<<"Not support this Constant val:"<<*rhs<<"\n";
-                        }
-                        
-                    }
-                    
-                 
-        
-                }
+    }
+    //a store to a local slot is final when the slot is loaded and no load
+    //after the store flows on into a binop after it
+    static bool IsFinalStore(Value *ptr, unsigned pos, const DenseMap<Value*, unsigned> &LastFlow) {
+        auto it = LastFlow.find(ptr);
+        return it != LastFlow.end() && it->second < pos;
+    }
+    bool IsCheckPoint(Value *op) const {
+        StoreInst *st = dyn_cast<StoreInst>(op);
+        return st && Index.count(st);
+    }
+    unsigned GetIndex(StoreInst *op) const {
+        return Index.lookup(op);
+    }
+    const std::vector<StoreInst*> &GetCheckPoints() const {
+        return CheckPoints;
+    }
+    void print(raw_ostream &OS) const {
+        OS << "CheckPoints for function '" << FuncName << "' (" << CheckPoints.size() << "):\n";
+        for (StoreInst *op : CheckPoints)
+            OS << "  " << *op << "\n";
+    }
+  };
+
+  //Standalone analysis: opt -analyze -tolerance-checkpoints reports the
+  //candidate checkpoints without touching the IR.
+  struct ToleranceCheckPoints : public FunctionPass {
+    static char ID;
+    CheckPointInfo CPI;
+    ToleranceCheckPoints() : FunctionPass(ID) {}
+    bool runOnFunction(Function &F) override {
+        CPI.analyze(F);
+        return false;
+    }
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.setPreservesAll();
+    }
+    void print(raw_ostream &OS, const Module *) const override {
+        CPI.print(OS);
+    }
+    CheckPointInfo &GetInfo() { return CPI; }
+  };
+
+  //Emit the check of one checkpoint store of op, right after op. vec holds
+  //copies of op in lanes base..base+copies-1; all of them are compared.
+  //recovery is NULL for returns and stores through pointers, which recover
+  //via a PHI.
+  void CreateCheckPoint(IRBuilder<> &builderafter, ShadowTable &ST, Instruction *op, Instruction *user, Value *vec, unsigned base, unsigned copies, AllocaInst *recovery){
+    Type* op_type = op->getType();
+    if(!IsShadowType(op_type))
+        return;
+    //save true value to recovery if no fault occur
+    //(batched checks repair the stored slot directly instead)
+    if(!BatchChecks && !ST.DetectOnly && recovery)
+        builderafter.CreateStore(op, recovery);
+    unsigned lanes = cast<VectorType>(vec->getType())->getNumElements();
+    Value *expect = builderafter.CreateVectorSplat(lanes, op, "expect");
+    Value *fault_check = CreateAnyMismatch(builderafter, vec, expect, base, copies);
+    CheckSite site = {fault_check, vec, base, copies, op, recovery};
+    ST.Checks.insert(std::make_pair(user, site));
+  }
+
+  //Check of a checkpoint store of an AN-encoded op: decode and compare.
+  void CreateANCheckPoint(IRBuilder<> &builderafter, ShadowTable &ST, Instruction *op, Instruction *user, Value *enc, AllocaInst *recovery){
+    if(!BatchChecks && !ST.DetectOnly && recovery)
+        builderafter.CreateStore(op, recovery);
+    Value *dec = CreateANDecode(builderafter, enc, op->getType(), ST);
+    Value *fault_check = builderafter.CreateICmpNE(dec, op, "Fcmp");
+    CheckSite site = {fault_check, enc, 0, 1, op, recovery};
+    ST.Checks.insert(std::make_pair(user, site));
+  }
+
+  //Induction step: recompute it, one scalar op, instead of replicating it
+  //in lanes. A mismatch is settled by CreateRecomputeVote. Its operand and its
+  //result are opaque copies, so the optimizer can neither fold it back
+  //into op nor reduce the compare to one of the operands.
+  void CreateIVCheck(IRBuilder<> &builderafter, ShadowTable &ST, BinaryOperator *op, StoreInst *user, AllocaInst *recovery){
+    if(!BatchChecks && !ST.DetectOnly && recovery)
+        builderafter.CreateStore(op, recovery);
+    Value *iv = CreateOpaqueCopy(builderafter, op->getOperand(0), "ivCopy");
+    Value *step = CreateOpaqueCopy(builderafter,
+                                   builderafter.CreateBinOp(op->getOpcode(), iv, op->getOperand(1), "ivStep"), "ivStepCopy");
+    Value *fault_check = builderafter.CreateICmpNE(step, op, "Fcmp");
+    CheckSite site = {fault_check, step, 0, 1, op, recovery, true};
+    ST.Checks.insert(std::make_pair(user, site));
+  }
+
+  //TRUMP: carry op as A*op. Add, sub, shl and mul by a constant commute
+  //with the encoding and run on the code words; other ops are recomputed
+  //on the decoded operands and the result is re-encoded.
+  void EncodeBinOp(BinaryOperator *op, ShadowTable &ST, CheckPointInfo &CPI, const std::vector<Value*> &RecoveryPoint){
+    IRBuilder<> builder(op);
+    Value *lhs = op->getOperand(0);
+    Value *rhs = op->getOperand(1);
+    Type *wide_ty = builder.getInt64Ty();
+    Value *enc;
+    switch (op->getOpcode()) {
+    case Instruction::Add:
+    case Instruction::Sub:
+        enc = builder.CreateBinOp(op->getOpcode(), GetANOpValue(builder, lhs, ST), GetANOpValue(builder, rhs, ST), "ANop");
+        break;
+    case Instruction::Shl://the shift amount is not encoded
+        enc = builder.CreateShl(GetANOpValue(builder, lhs, ST), builder.CreateZExt(rhs, wide_ty), "ANop");
+        break;
+    default:
+        if (op->getOpcode() == Instruction::Mul && isa<Constant>(rhs)) {
+            enc = builder.CreateMul(GetANOpValue(builder, lhs, ST), builder.CreateSExt(rhs, wide_ty), "ANop");
+        } else if (op->getOpcode() == Instruction::Mul && isa<Constant>(lhs)) {
+            enc = builder.CreateMul(builder.CreateSExt(lhs, wide_ty), GetANOpValue(builder, rhs, ST), "ANop");
+        } else {
+            Value *dec1 = CreateANDecode(builder, GetANOpValue(builder, lhs, ST), op->getType(), ST);
+            Value *dec2 = CreateANDecode(builder, GetANOpValue(builder, rhs, ST), op->getType(), ST);
+            enc = CreateANEncode(builder, builder.CreateBinOp(op->getOpcode(), dec1, dec2, "Dup"), ST);
         }
-        //Find load instruction & create vector before loadinst
-        else if (auto *op = dyn_cast<LoadInst>(&I)) {
-            bool VecFlag=false;//if load for binop
-                //find load is use for binary operator
-                for (auto &U : op->uses()) {
-                    User *user = U.getUser(); 
-                    if(isa<BinaryOperator>(*user)){
-                        VecFlag=true;
-                    }
-                }
-            if(VecFlag){
-                Value* loadinst_ptr=op->getPointerOperand();
-                Type* load_ty= op->getType();
-                //Value *load_dst = op->getOperand(0);
-                //errs()<<"XXXXXXXXXXXxloadinst_ptr:"<<*loadinst_ptr<<"\n";
-                //check if vec have already saved value, if not create insert element
-                if(vec_stored_map.Findpair(loadinst_ptr)){
-                    auto *vecdst = vec_stored_map.GetVector(loadinst_ptr);
-                    //errs()<<"XXXXXXXXXXXxvecdst:"<<*vecdst<<"\n";
-                }else
-                {
-                BuilderAfterflag=0;
-                BasicBlock::iterator instIt(I);
-                IRBuilder<> builderafter(instIt->getParent(), ++instIt);
-                ignoreuntilinst=instIt;
-                //errs()<<"*@@@@*set ignore point:"<<*instIt<<"\n";
-                //IRBuilder<> builder(op);
-                
-                //
-                //
-                /*Type* load_ty1= loadinst_ptr->getType();
-                errs()<<"~Load type:"<<*load_ty<<"\n";
-                errs()<<"~Load type1:"<<*load_ty1<<"\n";*/
-                /*errs()<<"*~Find op:"<<*op<<"\n";
-                errs()<<"*~Find Load_p:"<<*loadinst_ptr<<"\n";
-                errs()<<"Tolerance:Create Vector Element.\n";
-                PrintMap(&vec_map);
-                */
-                if(vec_map.Findpair(loadinst_ptr)){
-                    //##double1
-                    //unsigned size = load_ty->getPrimitiveSizeInBits();
-                    //errs()<<"Integer size:"<<size<<"\n";
-                    Value* val = CreateSIMDInst(builderafter,op,load_ty,"insertElmt");
-                   
-                
-                    //errs()<<"XXXXXXXXXXXxloadinst_ptr:"<<*loadinst_ptr<<"\n";
-                    auto *vec = vec_map.GetVector(loadinst_ptr);//original load's alloca inst
-                    //errs()<<"XXXXXXXXXXXxvec_ptr:"<<*vec<<"\n";
-                    //errs()<<"get vector:"<<*vec<<"\n";
-                    //errs()<<"get insertelement:"<<*val<<"\n";
-                    //create store into vector
-                    StoreInst* store_val=builderafter.CreateStore(val,vec);
-                    store_val->setAlignment(16);
-                }
-                //errs()<<"create store:"<<*store_val<<"\n";
+    }
+    ST.Shadow.AddPair(op, enc);
+
+    IRBuilder<> builderafter(op->getNextNode());
+    for (User *user : op->users()) {
+        if(isa<ReturnInst>(user) || (ST.ControlFlow && isa<SwitchInst>(user))){
+            if(ST.IsSelected(user))
+                CreateANCheckPoint(builderafter, ST, op, cast<Instruction>(user), enc, NULL);
+            continue;
+        }
+        StoreInst *st = dyn_cast<StoreInst>(user);
+        if(!st || st->getValueOperand()!=op)
+            continue;
+        Value *rdst = st->getPointerOperand();
+        if(ST.Shadow.IsAdded(rdst)){
+            builder.CreateStore(enc, ST.Shadow.GetVector(rdst))->setAlignment(8);
+            ST.Stored.insert(rdst);
+        }else if(isa<AllocaInst>(rdst)){
+            continue;//slot without a shadow
+        }
+        if(CPI.IsCheckPoint(st) && ST.IsSelected(st) && !ST.Reductions.count(st)){
+            CreateANCheckPoint(builderafter, ST, op, st, enc,
+                               cast_or_null<AllocaInst>(RecoveryPoint[CPI.GetIndex(st)]));
+        }
+    }
+  }
+
+  //An op that can share a shadow vector: its only use is a checkpoint store
+  //into a private slot whose shadow is never read back by a binop.
+  StoreInst *GetPackStore(BinaryOperator *op, ShadowTable &ST, CheckPointInfo &CPI){
+    if(!op->hasOneUse())
+        return NULL;
+    StoreInst *st = dyn_cast<StoreInst>(op->user_back());
+    if(!st || st->getValueOperand()!=op || st->getParent()!=op->getParent() || !CPI.IsCheckPoint(st))
+        return NULL;
+    //a reduction keeps its shadow in the slot for the exit check, which a
+    //packed pair never writes
+    if(ST.Reductions.count(st))
+        return NULL;
+    AllocaInst *slot = dyn_cast<AllocaInst>(st->getPointerOperand());
+    if(!slot)
+        return NULL;
+    for (User *user : slot->users()) {
+        if (LoadInst *ld = dyn_cast<LoadInst>(user)) {
+            for (User *user1 : ld->users())
+                if (isa<BinaryOperator>(user1))
+                    return NULL;
+        } else if (StoreInst *st1 = dyn_cast<StoreInst>(user)) {
+            if (st1->getPointerOperand() != slot)
+                return NULL;//slot escapes
+        } else {
+            return NULL;
+        }
+    }
+    return st;
+  }
+
+  //A store into a private slot may sink past inst: the slot cannot be
+  //touched through any other pointer, so only direct uses, calls and
+  //atomics get in the way.
+  bool CanSinkStorePast(StoreInst *st, Instruction *inst){
+    if (isa<CallInst>(inst) || isa<FenceInst>(inst) || inst->isAtomic())
+        return false;
+    for (Value *operand : inst->operands())
+        if (operand == st->getPointerOperand())
+            return false;
+    return true;
+  }
+
+  //Pair isomorphic, independent packable ops of one block, SLP style. The
+  //first op's store sinks down to the second op's store, so the packed
+  //vector op and both checks can sit right after the second op.
+  void FindPackPairs(Function &F, ShadowTable &ST, CheckPointInfo &CPI){
+    for (auto &B : F) {
+        BinaryOperator *first = NULL;
+        StoreInst *first_st = NULL;
+        bool first_stored = false;
+        for (auto it = B.begin(); it != B.end(); ) {
+            Instruction *inst = &*it++;
+            if (first && inst == first_st) {
+                first_stored = true;
+                continue;
+            }
+            BinaryOperator *op = dyn_cast<BinaryOperator>(inst);
+            StoreInst *st = op ? GetPackStore(op, ST, CPI) : NULL;
+            if (!st || !ST.IsSelected(st) || ST.GetLanes(op->getType()) < 4 || ST.IsANType(op->getType())) {
+                if (first && first_stored && !CanSinkStorePast(first_st, inst))
+                    first = NULL;
+                continue;
+            }
+            bool paired = false;
+            if (first && op->getOpcode() == first->getOpcode() && op->getType() == first->getType()) {
+                paired = true;
+                if (first_stored) {
+                    for (Instruction *next = op->getNextNode(); next != st; next = next->getNextNode())
+                        if (!CanSinkStorePast(first_st, next))
+                            paired = false;
+                    if (paired)
+                        first_st->moveBefore(st);
                 }
             }
-        }/*else if (auto *op = dyn_cast<CastInst>(&I)) {
-        }*/
-        //Find operator to neon duplication
-        else if (auto *op = dyn_cast<BinaryOperator>(&I)) {
-            //errs()<<"Tolerance:Find BinaryOperator\n";
-            auto op_name= I.getOpcodeName();
-            Type* op_type = op->getType();
-            //auto op_name1= op->getOpcode();
-            //errs()<<"OP:"<<*op<<"\n";
-            //errs()<<"OP Type:"<<*op_type<<"\n";
-            //errs()<<"-*-*BinaryOperator is:"<<op_name<<"\n";
-            // Insert at the point where the instruction `op` appears.
-            IRBuilder<> builder(op);
-            Value* lhs = op->getOperand(0);
-            Value* rhs = op->getOperand(1);
-            //errs()<<"lhs:"<<*lhs<<"\n";
-            //errs()<<"rhs:"<<*rhs<<"\n";
-            //Value *mul_value = ConstantInt::get(op->getType() , 3); 
-            //Value* mul = builder.CreateMul(lhs, mul_value);
-            Value* load_val1=GetVecOpValue(builder,lhs,vec_map,op_type);
-            Value* load_val2=GetVecOpValue(builder,rhs,vec_map,op_type);
-            Value *vop;
-            //free time, using binaryoperator::create!!
-            //#1
-            if(strcmp(op_name, "add") == 0){// find op is "add"
-            //errs()<<"Find add:"<<op_name<<"\n";
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateAdd(load_val1,load_val2,"Vop");
-                    //errs()<<"Create add:"<<*vadd<<"\n";
-                    //map add
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    }
-            }else if(strcmp(op_name, "sub") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateSub(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "mul") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateMul(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    //errs()<<"original Vop:"<<*op<<"\n";
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "sdiv") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateSDiv(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "fadd") == 0){// find op is "fadd"
-            //errs()<<"Find add:"<<op_name<<"\n";
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateFAdd(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vadd<<"\n";
-                    //map add
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "fsub") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateFSub(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "fmul") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateFMul(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "fdiv") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateFDiv(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "and") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateAnd(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "or") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateOr(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "xor") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateXor(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "shl") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateShl(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "lshr") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateLShr(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "ashr") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateAShr(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "srem") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateSRem(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "urem") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateURem(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else if(strcmp(op_name, "frem") == 0){
-                    if(load_val1!=NULL&&load_val2!=NULL) {
-                    vop = builder.CreateFRem(load_val1,load_val2,"Vop");
-                    //errs()<<"Create Vop:"<<*vop<<"\n";
-                    vec_map.AddPair(op, vop);
-                    }else{
-                    errs()<<"Error: in Vector operator:"<<*op<<"\n";
-                    
-                    }
-            }else {
-                errs()<<"####1 Not Support Operator Type:"<<*op_name<<"\n";
-                I.dump();
+            if (paired) {
+                ST.PackPartner[first] = op;
+                ST.PackPartner[op] = first;
+                first = NULL;
+            } else {
+                first = op;
+                first_st = st;
+                first_stored = false;
             }
+        }
+    }
+  }
 
-            /**Find Check Point**/
-            //if find store, do vecop's store, and check is checkpoint? then insert mul 3
-            //if not, just create vop above
-            for (auto &U : op->uses()) {
-                User *user = U.getUser();  // A User is anything with operands.
-                //Value* v= U.get();
-                //errs()<<"*****Find:"<<*user<<"\n";
-                //errs()<<*op<<" - Find Check Point:"<<*user<<"\n";
-
-                int recovery_count=0;
-                if(isa<StoreInst>(*user)){//Find final store 
-                    bool Cflag=false;
-                    Value *rdst = user->getOperand(1);
-                    //errs()<<"XXXXXXXXXXXxrdst:"<<*rdst<<"\n";
-                    Value *vecdst;
-                    /*if(isa<GetElementPtrInst>(rdst)){
-                        errs()<<"XXXXXXXXXXXGetElementPtrInst:"<<*rdst<<"\n";
-                        GetElementPtrInst* rinst=cast<GetElementPtrInst>(rdst);
-                        Type* scalar_t= rinst->getSourceElementType();//not pointer
-                        createAllocaVec(builder,rdst,vec_map, scalar_t);
-                    }*/
-                    if(vec_map.IsAdded(rdst)){
-                        vecdst  = vec_map.GetVector(rdst);  
-                        //errs()<<"XXXXXXXXXXXxVOPd:"<<*vop<<"\n";
-                        //errs()<<"XXXXXXXXXXXxFind:"<<*vecdst<<"\n";
-                        Value *vecstr = builder.CreateStore(vop,vecdst);
-                        vec_stored_map.AddPair(rdst,vecdst);//save vec have stored map  
-                    }
-
-                    for(int i=0; i<CheckPoint.size(); i++){
-                       
-                        //errs()<<"@@@@@@@@@@@@@@@@Nocheck:"<<*CheckPoint[i]<<"\n";
-                        //errs()<<"@@@@@@@@@@@@@@@@User:"<<*user<<"\n";
-                        if(user==CheckPoint[i]){
-
-                            Cflag=true;
-                            //errs()<<"@FUCK:"<<*user<<"\n";
-                            recovery_count=i;//save recovery inst num
-                        }
-                    }
-        
-                    //Value* v= U.get();
-             
-
-                    //Instruction* op1 = cast<Instruction>(v);
-                    //if(auto *op1 = dyn_cast<StoreInst>(*user)){//Find final store 
-                    if(Cflag){//check is need
-                        BasicBlock::iterator instIt(I);
-                        IRBuilder<> builderafter(instIt->getParent(), ++instIt);
-                        //errs()<<"*@@@@*Set ignore point:"<<*instIt<<"\n";
-                        ignoreuntilinst=instIt;
-                        BuilderAfterflag=0;
-                        //#2
-                        Value *mul,*mul_value;
-                        if(op_type->isIntegerTy()){
-                            mul_value = ConstantInt::get(op->getType() , 3); 
-                            mul = builderafter.CreateMul(op, mul_value,"Fmul");
-                            //errs()<<"mul"<<*mul<<"\n";
-                        }else if(op_type->isFloatTy()){
-                            mul_value = ConstantFP::get(op->getType() , 3.0); 
-                            mul = builderafter.CreateFMul(op, mul_value,"Fmul");
-                            //errs()<<"Fmul"<<*mul<<"\n";
-                        }else if(op_type->isDoubleTy()){
-                            mul_value = ConstantFP::get(op->getType() , 3.0); 
-                            mul = builderafter.CreateFMul(op, mul_value,"Fmul");
-                            //errs()<<"Fmul"<<*mul<<"\n";
-                        }else {
-                            errs()<<"####2 Not Support Operator Type:"<<*op_type<<"\n";
-                        }
-                        //create load vector
-                        //Value* final_store=user->getOperand(1);
-                        //errs()<<"*XXXXX*:"<<*user->getOperand(1)<<"\n";
-                        //auto *vec = vec_map.GetVector(final_store);
-                        //auto *op_vec = vec_map.GetVector(op);
-                        //create final store vector
-                        //auto* store_vec=builder.CreateStore(op_vec,vec);
-                        auto* load_vec=builder.CreateLoad(vecdst);//before is ok
-                        load_vec->setAlignment(4);
-                        
-                        //create sum of three copies
-                        uint64_t lane0= 0;
-                        uint64_t lane1= 1;
-                        uint64_t lane2= 2;
-                        Value *ex0;
-                        Value *ex1;
-                        Value *ex2;
-                        //unsigned size = op_type->getPrimitiveSizeInBits();
-                        //errs()<<"Integer size:"<<size<<"\n";
-                       
-                        //#2.5 float --> three element, double --> two element
-                        if(op_type->isDoubleTy()){
-                            ex0=builder.CreateExtractElement(load_vec,lane0,"extractE");
-                            ex1=builder.CreateExtractElement(load_vec,lane1,"extractE");
-                        }else if(op_type->isIntegerTy()||op_type->isFloatTy()){
-                            ex0=builder.CreateExtractElement(load_vec,lane0,"extractE");
-                            ex1=builder.CreateExtractElement(load_vec,lane1,"extractE");
-                            ex2=builder.CreateExtractElement(load_vec,lane2,"extractE");
-                        }else {
-                            errs()<<"####2.5 Not Support Operator Type:"<<*op_type<<"\n";
-                        }
-                        
-                        
-                        //Instruction* recoveryinst=cast<Instruction>(ex2);
-                        //AllocaInst* recovery=builder.CreateAlloca(recoveryinst->getType(),nullptr,"Recovery");
-                        //recovery->setAlignment(4);
-                        //errs()<<"Recovery:"<<*recovery<<"\n";
-                        //save true value to recovery if no fault occur
-                        //errs()<<"##########################"<<*op<<"\n";
-                        //errs()<<"1##########################"<<*RecoveryPoint[recovery_count]<<"\n";
-                        Value *Rval = builderafter.CreateStore(op, RecoveryPoint[recovery_count]);
-                        //errs()<<"2##########################\n";
-                        //#3
-                        Value *vadd,*vadd1,*fault_check;
-                        if(op_type->isIntegerTy()){
-                            vadd = builder.CreateAdd(ex0,ex1,"sum");
-                            vadd1 = builder.CreateAdd(vadd ,ex2,"sum");
-                            fault_check=builderafter.CreateICmpNE(vadd1,mul,"Fcmp");
-                           
-                        //errs()<<"add"<<*vadd<<"\n";
-                        }else if(op_type->isFloatTy()){
-                            vadd = builder.CreateFAdd(ex0,ex1,"sum");
-                            vadd1 = builder.CreateFAdd(vadd ,ex2,"sum");
-                            //errs()<<"Fadd"<<*vadd<<"\n";
-                            fault_check=builderafter.CreateFCmpUNE(vadd1,mul,"Fcmp");
-                        }else if(op_type->isDoubleTy()){
-                            vadd = builder.CreateFAdd(ex0,ex1,"sum");
-                            vadd1 = builder.CreateFAdd(vadd ,ex1,"sum");//ex1 add double times
-                            //errs()<<"Fadd"<<*vadd<<"\n";
-                            fault_check=builderafter.CreateFCmpUNE(vadd1,mul,"Fcmp");
-                        }else {
-                            errs()<<"####3 Not Support Operator Type:"<<*op_type<<"\n";
-                        }
-                        //chech create after mutltiple 3
-                       
-                        //errs()<<"CMP"<<*fault_check<<"\n";
-                        //errs()<<"****"<<*user<<"\n";
-                        check_map.AddPair(user,fault_check);
-                        check_map.AddPair(fault_check,ex0);
-                        recovery_map.AddPair(user,op);
-                        recovery_map1.AddPair(user,RecoveryPoint[recovery_count]);
-                        recovery_inst++;
-                        //TerminatorInst *ThenTerm = nullptr, *ElseTerm = nullptr;
-                        //BasicBlock::iterator it(op1);
-
-                        //TerminatorInst *ThenTerm , *ElseTerm ;
-
-                        //SplitBlockAndInsertIfThenElse(fault_check, op1, &ThenTerm, &ElseTerm,nullptr);
-                        //builderafter.SetInsertPoint(ThenTerm);
-
-                        //builderafter.SetInsertPoint(ElseTerm);
-                        //user->setOperand(U.getOperandNo(), mul);//final store
-                    }//Cflag end
-
-                }//Find final store end
+  //Duplicate op into one vector op over the shadows of its operands, store
+  //the result to the shadow of each slot op is stored to, and check the
+  //checkpoint stores.
+  void VectorizeBinOp(BinaryOperator *op, ShadowTable &ST, CheckPointInfo &CPI, const std::vector<Value*> &RecoveryPoint){
+    Type* op_type = op->getType();
+    if(!IsShadowType(op_type))
+        return;//vector binops of the source are left alone
+    if(StoreInst *st = ST.IVSteps.lookup(op)){
+        IRBuilder<> builderafter(op->getNextNode());
+        CreateIVCheck(builderafter, ST, op, st, cast_or_null<AllocaInst>(RecoveryPoint[CPI.GetIndex(st)]));
+        return;
+    }
+    if(ST.IsANType(op_type)){
+        EncodeBinOp(op, ST, CPI, RecoveryPoint);
+        return;
+    }
+    // Insert at the point where the instruction `op` appears.
+    IRBuilder<> builder(op);
+    Value* load_val1=GetVecOpValue(builder,op->getOperand(0),ST,op_type);
+    Value* load_val2=GetVecOpValue(builder,op->getOperand(1),ST,op_type);
+    if(load_val1==NULL||load_val2==NULL){
+        errs()<<"Error: in Vector operator:"<<*op<<"\n";
+        Value *partner = ST.PackPartner.lookup(op);
+        ST.PackPartner.erase(op);
+        ST.PackPartner.erase(partner);
+        return;
+    }
+    IRBuilder<> builderafter(op->getNextNode());
+    Value *first = ST.PackPartner.lookup(op);
+    if(first && !ST.PackOperands.count(first)){
+        //first of a pair, vectorized together with its partner
+        ST.PackOperands[op] = std::make_pair(load_val1, load_val2);
+        return;
+    }
+    if(first){
+        //lanes [0,copies) hold the first op, the rest hold op
+        unsigned lanes = ST.GetLanes(op_type);
+        unsigned copies = lanes/2;
+        SmallVector<uint32_t, 16> mask;
+        for (unsigned i = 0; i < lanes; i++)
+            mask.push_back(i < copies ? i : lanes + i - copies);
+        std::pair<Value*, Value*> first_ops = ST.PackOperands[first];
+        Value *pack1 = builder.CreateShuffleVector(first_ops.first, load_val1, mask, "pack");
+        Value *pack2 = builder.CreateShuffleVector(first_ops.second, load_val2, mask, "pack");
+        Value *vop = builder.CreateBinOp(op->getOpcode(),pack1,pack2,"Vop");
+        BinaryOperator *first_op = cast<BinaryOperator>(first);
+        StoreInst *first_st = cast<StoreInst>(first_op->user_back());
+        StoreInst *st = cast<StoreInst>(op->user_back());
+        CreateCheckPoint(builderafter, ST, first_op, first_st, vop, 0, copies,
+                         cast_or_null<AllocaInst>(RecoveryPoint[CPI.GetIndex(first_st)]));
+        CreateCheckPoint(builderafter, ST, op, st, vop, copies, lanes-copies,
+                         cast_or_null<AllocaInst>(RecoveryPoint[CPI.GetIndex(st)]));
+        return;
+    }
+    Value *vop = builder.CreateBinOp(op->getOpcode(),load_val1,load_val2,"Vop");
+    ST.Shadow.AddPair(op, vop);
+
+    /**Find Check Point**/
+    //if find store, do vecop's store, and check is checkpoint?
+    //stores through pointers have no shadow slot, but are still checked;
+    //so are returns of SSA values
+    for (User *user : op->users()) {
+        if(isa<ReturnInst>(user) || (ST.ControlFlow && isa<SwitchInst>(user))){
+            if(ST.IsSelected(user))
+                CreateCheckPoint(builderafter, ST, op, cast<Instruction>(user), vop, 0, ST.GetLanes(op_type), NULL);
+            continue;
+        }
+        StoreInst *st = dyn_cast<StoreInst>(user);
+        if(!st || st->getValueOperand()!=op)
+            continue;
+        Value *rdst = st->getPointerOperand();
+        if(ST.Shadow.IsAdded(rdst)){
+            Value *vecdst = ST.Shadow.GetVector(rdst);
+            builder.CreateStore(vop,vecdst);
+            ST.Stored.insert(rdst);//save vec have stored map
+        }else if(isa<AllocaInst>(rdst)){
+            continue;//slot without a shadow
+        }
+        if(CPI.IsCheckPoint(st) && ST.IsSelected(st) && !ST.Reductions.count(st)){
+            CreateCheckPoint(builderafter, ST, op, st, vop, 0, ST.GetLanes(op_type),
+                             cast_or_null<AllocaInst>(RecoveryPoint[CPI.GetIndex(st)]));
+        }
+    }
+  }
+
+/**===================SSA values========================**/
+  //A PHI of protected values gets a PHI of their shadows; the incoming
+  //shadows are added by CompleteShadowPhis once all of them exist.
+  void CreateShadowPhi(PHINode *op, ShadowTable &ST){
+    Type *op_type = op->getType();
+    Type *shadow_ty;
+    if (ST.IsANType(op_type))
+        shadow_ty = Type::getInt64Ty(op->getContext());
+    else if (op_type->isIntegerTy() || op_type->isFloatTy() || op_type->isDoubleTy())
+        shadow_ty = VectorType::get(op_type, ST.GetLanes(op_type));
+    else
+        return;
+    IRBuilder<> builder(op);
+    PHINode *vphi = builder.CreatePHI(shadow_ty, op->getNumIncomingValues(), "Vphi");
+    ST.Shadow.AddPair(op, vphi);
+    ST.Phis.push_back(op);
+  }
+
+  //Fill the shadow PHIs, building missing incoming shadows at the end of
+  //each predecessor, and check the PHI values that leave through a store,
+  //a return or a switch, as binop results are.
+  void CompleteShadowPhis(ShadowTable &ST){
+    for (PHINode *op : ST.Phis) {
+        PHINode *vphi = cast<PHINode>(ST.Shadow.GetVector(op));
+        bool an = ST.IsANType(op->getType());
+        for (unsigned i = 0; i < op->getNumIncomingValues(); i++) {
+            BasicBlock *pred = op->getIncomingBlock(i);
+            //a predecessor listed twice must bring the same shadow
+            int seen = vphi->getBasicBlockIndex(pred);
+            Value *shadow;
+            if (seen >= 0) {
+                shadow = vphi->getIncomingValue(seen);
+            } else {
+                IRBuilder<> builder(pred->getTerminator());
+                Value *val = op->getIncomingValue(i);
+                shadow = an ? GetANOpValue(builder, val, ST) : GetVecOpValue(builder, val, ST, op->getType());
             }
-            
-          }
-        } else{//builder after flag
-                //errs()<<"@@@@Ignore instruction:\n";
-                //I.dump();
-                BasicBlock::iterator instIt(I);
-                //errs()<<*<<"\n";
-                if(++instIt==ignoreuntilinst){
-                    //errs()<<"*@@@@*Reset builderafter at:"<<*instIt<<"\n";
-                    BuilderAfterflag=1;
-                }
-                //BuilderAfterflag=1;
+            vphi->addIncoming(shadow, pred);
+        }
+        IRBuilder<> builderafter(&*op->getParent()->getFirstInsertionPt());
+        for (User *user : op->users()) {
+            Instruction *inst = cast<Instruction>(user);
+            StoreInst *st = dyn_cast<StoreInst>(inst);
+            if (!(isa<ReturnInst>(inst) || (ST.ControlFlow && isa<SwitchInst>(inst)) ||
+                  (st && st->getValueOperand() == op)) ||
+                ST.Checks.count(inst) || !ST.IsSelected(inst))
+                continue;
+            if (an)
+                CreateANCheckPoint(builderafter, ST, op, inst, vphi, NULL);
+            else
+                CreateCheckPoint(builderafter, ST, op, inst, vphi, 0, ST.GetLanes(op->getType()), NULL);
+        }
+    }
+  }
+
+/**===================Loops========================**/
+  //A slot that is only loaded from and stored to directly.
+  bool IsPrivateSlot(Value *slot){
+    if (!isa<AllocaInst>(slot))
+        return false;
+    for (User *user : slot->users()) {
+        if (isa<LoadInst>(user))
+            continue;
+        StoreInst *st = dyn_cast<StoreInst>(user);
+        if (!st || st->getPointerOperand() != slot)
+            return false;
+    }
+    return true;
+  }
+  //stores to slot inside L
+  unsigned CountStores(Value *slot, Loop *L){
+    unsigned count = 0;
+    for (User *user : slot->users())
+        if (isa<StoreInst>(user) && L->contains(cast<Instruction>(user)))
+            count++;
+    return count;
+  }
+
+  //Classify the checkpoints inside loops, before anything is rewritten.
+  //An induction step, slot = load slot +- constant with the slot read in
+  //the header, is checked by recomputation. A reduction, whose slot is
+  //stored once in the loop and only read there by binops, keeps its shadow
+  //accumulating across iterations and is checked once at the loop exit.
+  void AnalyzeLoops(Function &F, ShadowTable &ST, CheckPointInfo &CPI, LoopInfo &LI){
+    for (StoreInst *st : CPI.GetCheckPoints()) {
+        Loop *L = LI.getLoopFor(st->getParent());
+        BinaryOperator *op = dyn_cast<BinaryOperator>(st->getValueOperand());
+        Value *slot = st->getPointerOperand();
+        if (!L || !op || !ST.IsSelected(st) || !L->contains(op) || !IsPrivateSlot(slot) || CountStores(slot, L) != 1)
+            continue;
+        bool in_header = false, binops_only = true, loaded = false;
+        for (User *user : slot->users()) {
+            LoadInst *ld = dyn_cast<LoadInst>(user);
+            if (!ld || !L->contains(ld))
+                continue;
+            loaded = true;
+            if (ld->getParent() == L->getHeader())
+                in_header = true;
+            for (User *user1 : ld->users())
+                if (!isa<BinaryOperator>(user1))
+                    binops_only = false;
+        }
+        LoadInst *ld = dyn_cast<LoadInst>(op->getOperand(0));
+        bool step = (op->getOpcode() == Instruction::Add || op->getOpcode() == Instruction::Sub) &&
+                    ld && ld->getPointerOperand() == slot && isa<ConstantInt>(op->getOperand(1));
+        if (step && in_header && op->hasOneUse()) {
+            ST.IVSteps[op] = st;
+        } else if (loaded && binops_only && L->getLoopPreheader() && L->getExitBlock() && L->hasDedicatedExits()) {
+            ST.Reductions[st] = L->getExitBlock();
+            ST.ReductionSlots[slot] = L;
+        }
+    }
+  }
+
+  //Loop whose preheader can build the shadow splat of the slot ld reads:
+  //the reduction's loop, else the outermost loop around ld that never
+  //writes the slot. NULL to splat right after ld.
+  Loop *GetSplatLoop(LoadInst *ld, ShadowTable &ST, LoopInfo &LI){
+    Value *slot = ld->getPointerOperand();
+    Loop *L = ST.ReductionSlots.lookup(slot);
+    if (L && L->contains(ld))
+        return L;
+    if (!IsPrivateSlot(slot))
+        return NULL;
+    Loop *found = NULL;
+    for (L = LI.getLoopFor(ld->getParent()); L; L = L->getParentLoop()) {
+        if (!L->getLoopPreheader() || CountStores(slot, L))
+            break;
+        found = L;
+    }
+    return found;
+  }
+
+  //Sunk reduction checks: the shadow accumulated in the loop against the
+  //scalar, once at the exit; the cold path repairs the slot.
+  void InsertExitChecks(ShadowTable &ST, RecoveryFn recover){
+    unsigned site_id = ST.Checks.size();
+    for (auto &Red : ST.Reductions) {
+        StoreInst *op = Red.first;
+        Value *slot = op->getPointerOperand();
+        Type *ty = op->getValueOperand()->getType();
+        IRBuilder<> builder(&*Red.second->getFirstInsertionPt());
+        LoadInst *scalar = builder.CreateLoad(slot, "exitVal");
+        LoadInst *shadow = builder.CreateLoad(ST.Shadow.GetVector(slot), "exitShadow");
+        Value *fault_check;
+        unsigned copies = 1;
+        if (ST.IsANType(ty)) {
+            shadow->setAlignment(8);
+            fault_check = builder.CreateICmpNE(CreateANDecode(builder, shadow, ty, ST), scalar, "Fcmp");
+        } else {
+            shadow->setAlignment(16);
+            copies = cast<VectorType>(shadow->getType())->getNumElements();
+            Value *expect = builder.CreateVectorSplat(copies, scalar, "expect");
+            fault_check = CreateAnyMismatch(builder, shadow, expect, 0, copies);
+        }
+        CheckSite site = {fault_check, shadow, 0, copies, scalar, NULL};
+        MDNode *Unlikely = MDBuilder(op->getContext()).createBranchWeights(1, 1 << 20);
+        TerminatorInst *exitTerm = SplitBlockAndInsertIfThen(fault_check, &*builder.GetInsertPoint(), false, Unlikely);
+        IRBuilder<> builderExit(exitTerm);
+        int id = site_id++;
+        CreateCountCall(builderExit, ST, op, id);
+        if (ST.DetectOnly)
+            CreateFaultCall(builderExit, ST, builderExit.getInt32(id));
+        else
+            builderExit.CreateStore(RecoverSite(builderExit, ST, site, recover), slot);
+        ST.RecoveryChecks++;
+    }
+  }
+
+/**===================Control flow========================**/
+  //Compare cmp redone on the shadows of its operands; NULL when neither
+  //operand has a shadow, as redoing it would only compare the same splats.
+  Value *CreateShadowCompare(IRBuilder<> &builder, CmpInst *cmp, ShadowTable &ST){
+    Value *lhs = cmp->getOperand(0), *rhs = cmp->getOperand(1);
+    Type *ty = lhs->getType();
+    if (!(ty->isIntegerTy() || ty->isFloatTy() || ty->isDoubleTy()))
+        return NULL;
+    if (!HasShadow(lhs, ST) && !HasShadow(rhs, ST))
+        return NULL;
+    if (ST.IsANType(ty)) {
+        //decode both code words and compare again; a code word that is no
+        //longer a multiple of A was hit, and the scalar compare stands
+        Value *enc1 = GetANOpValue(builder, lhs, ST), *enc2 = GetANOpValue(builder, rhs, ST);
+        Value *A = builder.getInt64(ST.ANConstant), *zero = builder.getInt64(0);
+        Value *valid = builder.CreateAnd(builder.CreateICmpEQ(builder.CreateSRem(enc1, A), zero),
+                                         builder.CreateICmpEQ(builder.CreateSRem(enc2, A), zero), "validAN");
+        Value *vcmp = builder.CreateICmp(cmp->getPredicate(), CreateANDecode(builder, enc1, ty, ST),
+                                         CreateANDecode(builder, enc2, ty, ST), "Vcmp");
+        return builder.CreateSelect(valid, vcmp, cmp);
+    }
+    Value *v1 = GetVecOpValue(builder, lhs, ST, ty), *v2 = GetVecOpValue(builder, rhs, ST, ty);
+    if (!v1 || !v2)
+        return NULL;
+    if (cmp->isFPPredicate())
+        return builder.CreateFCmp(cmp->getPredicate(), v1, v2, "Vcmp");
+    return builder.CreateICmp(cmp->getPredicate(), v1, v2, "Vcmp");
+  }
+
+  //Compares that decide a conditional branch or a select. Taken before
+  //the rewrite, so the compares of the pass's own checks are not checked
+  //again.
+  void CollectCompares(Function &F, SmallVectorImpl<CmpInst*> &Cmps){
+    for (Instruction &I : instructions(F)) {
+        CmpInst *cmp = dyn_cast<CmpInst>(&I);
+        if (!cmp)
+            continue;
+        for (User *user : cmp->users()) {
+            BranchInst *br = dyn_cast<BranchInst>(user);
+            SelectInst *sel = dyn_cast<SelectInst>(user);
+            if ((br && br->isConditional()) || (sel && sel->getCondition() == cmp)) {
+                Cmps.push_back(cmp);
+                break;
             }
-          //I.dump();
- 
         }
-       
-        
-        
+    }
+  }
+
+  //Each compare of Cmps is redone on the shadows right after the scalar
+  //compare. The hot path tests the <N x i1> lane mask against sext(cmp);
+  //the cold path takes the majority of the scalar and the N lanes (AN:
+  //the decoded compare) as the condition, or reports the fault when
+  //detecting only.
+  void ProtectCompares(Function &F, ShadowTable &ST, ArrayRef<CmpInst*> Cmps){
+    MDNode *Unlikely = MDBuilder(F.getContext()).createBranchWeights(1, 1 << 20);
+    unsigned site_id = ST.Checks.size() + ST.Reductions.size();
+    for (CmpInst *cmp : Cmps) {
+        IRBuilder<> builder(cmp->getNextNode());
+        Value *vcmp = CreateShadowCompare(builder, cmp, ST);
+        if (!vcmp)
+            continue;
+        Value *fault_check, *mask = NULL;
+        if (vcmp->getType()->isVectorTy()) {
+            unsigned lanes = cast<VectorType>(vcmp->getType())->getNumElements();
+            mask = builder.CreateBitCast(vcmp, builder.getIntNTy(lanes), "cmpMask");
+            fault_check = builder.CreateICmpNE(mask, builder.CreateSExt(cmp, mask->getType()), "Fcmp");
+        } else {
+            fault_check = builder.CreateICmpNE(vcmp, cmp, "Fcmp");
+        }
+        TerminatorInst *cmpTerm = SplitBlockAndInsertIfThen(fault_check, &*builder.GetInsertPoint(), false, Unlikely);
+        IRBuilder<> builderCold(cmpTerm);
+        ST.RecoveryChecks++;
+        ST.ORE->emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "CompareCheck", cmp)
+                   << "compare checked as " << ore::NV("Kind", mask ? "lanes" : "AN code");
+        });
+        int id = site_id++;
+        CreateCountCall(builderCold, ST, cmp, id);
+        if (ST.DetectOnly) {
+            CreateFaultCall(builderCold, ST, builderCold.getInt32(id));
+            continue;
+        }
+        Value *vote = vcmp;
+        if (mask) {
+            unsigned lanes = mask->getType()->getIntegerBitWidth();
+            Function *ctpop = Intrinsic::getDeclaration(F.getParent(), Intrinsic::ctpop, mask->getType());
+            Value *votes = builderCold.CreateAdd(builderCold.CreateCall(ctpop, {mask}),
+                                                 builderCold.CreateZExt(cmp, mask->getType()), "votes");
+            vote = builderCold.CreateICmpUGE(votes, ConstantInt::get(mask->getType(), (lanes+1)/2+1), "majority");
+        }
+        BasicBlock *head = cmpTerm->getParent()->getSinglePredecessor();
+        BasicBlock *tail = cmpTerm->getSuccessor(0);
+        IRBuilder<> builderTail(&tail->front());
+        PHINode *cond = builderTail.CreatePHI(cmp->getType(), 2, "Recovered");
+        cond->addIncoming(cmp, head);
+        cond->addIncoming(vote, cmpTerm->getParent());
+        for (auto UI = cmp->use_begin(); UI != cmp->use_end();) {
+            Use &U = *UI++;
+            if (isa<BranchInst>(U.getUser()) || (isa<SelectInst>(U.getUser()) && U.getOperandNo() == 0))
+                U.set(cond);
+        }
+        ST.RecoveryNum++;
+    }
+  }
+
+  //Block signatures: every block stores its own signature to cfSig on
+  //entry, after checking that cfSig holds the signature of one of its
+  //predecessors. A fault that jumps to a wrong block is caught at the next
+  //checked block. A block that is the only successor of its only
+  //predecessor is reached by fallthrough and shares that signature.
+  //cfSig is volatile so that promotion cannot fold the checks away. Runs
+  //before the checks are inserted, so their cold blocks go unsigned.
+  void InsertBlockSignatures(Function &F, ShadowTable &ST){
+    DenseMap<BasicBlock*, unsigned> Sig;
+    SmallVector<BasicBlock*, 32> Checked;
+    ReversePostOrderTraversal<Function*> RPOT(&F);
+    unsigned next = 0;
+    for (BasicBlock *BB : RPOT) {
+        BasicBlock *pred = BB->getSinglePredecessor();
+        if (pred && pred->getSingleSuccessor() == BB) {
+            Sig[BB] = Sig[pred];
+            continue;
+        }
+        //golden-ratio spread, so one flipped bit never gives another block
+        Sig[BB] = (++next) * 0x9E3779B1u;
+        Checked.push_back(BB);
+    }
+    if (Checked.size() < 2)
+        return;
+    //the signatures each checked block accepts, taken before any split:
+    //a split moves the terminator of a block into a new tail, which would
+    //then show up as the predecessor of the blocks checked after it
+    std::vector<SmallVector<unsigned, 8> > PredSigs(Checked.size());
+    for (size_t i = 0; i < Checked.size(); i++) {
+        SmallVector<unsigned, 8> &Accepted = PredSigs[i];
+        for (BasicBlock *pred : predecessors(Checked[i]))
+            if (Sig.count(pred))//unreachable blocks never jump here
+                Accepted.push_back(Sig[pred]);
+        std::sort(Accepted.begin(), Accepted.end());
+        Accepted.erase(std::unique(Accepted.begin(), Accepted.end()), Accepted.end());
+    }
+    BasicBlock &Entry = F.getEntryBlock();
+    IRBuilder<> builderEntry(&*Entry.getFirstInsertionPt());
+    AllocaInst *sig_slot = builderEntry.CreateAlloca(builderEntry.getInt32Ty(), NULL, "cfSig");
+    MDNode *Unlikely = MDBuilder(F.getContext()).createBranchWeights(1, 1 << 20);
+    int site = -1;
+    for (size_t i = 0; i < Checked.size(); i++) {
+        BasicBlock *BB = Checked[i];
+        Instruction *first = &*BB->getFirstInsertionPt();
+        IRBuilder<> builder(BB == &Entry ? sig_slot->getNextNode() : first);
+        if (BB != &Entry && !BB->isEHPad()) {
+            if (!PredSigs[i].empty() && PredSigs[i].size() <= 8) {
+                Value *cur = builder.CreateLoad(sig_slot, true, "curSig");
+                Value *fault_check = builder.getTrue();
+                for (unsigned pred_sig : PredSigs[i])
+                    fault_check = builder.CreateAnd(fault_check, builder.CreateICmpNE(cur, builder.getInt32(pred_sig)));
+                TerminatorInst *sigTerm = SplitBlockAndInsertIfThen(fault_check, &*builder.GetInsertPoint(), false, Unlikely);
+                IRBuilder<> builderFault(sigTerm);
+                CreateCountCall(builderFault, ST, first, site);
+                CreateFaultCall(builderFault, ST, builderFault.getInt32(site--));
+                builder.SetInsertPoint(&*sigTerm->getSuccessor(0)->getFirstInsertionPt());
+                ST.RecoveryChecks++;
+            }
+        }
+        builder.CreateStore(builder.getInt32(Sig[BB]), sig_slot, true);
+    }
+  }
+
+/**===================Selective protection========================**/
+  //Binops and slots whose values reach val, i.e. the shadow computation a
+  //check of val needs. Slots are followed through every store.
+  void CollectValueSlice(Value *val, SmallPtrSetImpl<Value*> &Slice){
+    SmallVector<Value*, 16> Worklist;
+    Worklist.push_back(val);
+    while (!Worklist.empty()) {
+        Value *val = Worklist.pop_back_val();
+        if (BinaryOperator *bin = dyn_cast<BinaryOperator>(val)) {
+            if (!Slice.insert(bin).second)
+                continue;
+            Worklist.push_back(bin->getOperand(0));
+            Worklist.push_back(bin->getOperand(1));
+        } else if (PHINode *phi = dyn_cast<PHINode>(val)) {
+            if (!Slice.insert(phi).second)
+                continue;
+            for (Value *in : phi->incoming_values())
+                Worklist.push_back(in);
+        } else if (LoadInst *ld = dyn_cast<LoadInst>(val)) {
+            Value *slot = ld->getPointerOperand();
+            if (!isa<AllocaInst>(slot) || !Slice.insert(slot).second)
+                continue;
+            for (User *user : slot->users()) {
+                StoreInst *st = dyn_cast<StoreInst>(user);
+                if (st && st->getPointerOperand() == slot)
+                    Worklist.push_back(st->getValueOperand());
+            }
+        }
+    }
+  }
+  void CollectSlice(StoreInst *op, SmallPtrSetImpl<Value*> &Slice){
+    Slice.insert(op->getPointerOperand());
+    CollectValueSlice(op->getValueOperand(), Slice);
+  }
+
+  //fraction as a percentage with one decimal, for remarks
+  std::string Percent(double fraction){
+    std::string str;
+    raw_string_ostream OS(str);
+    OS << format("%.1f", 100 * fraction);
+    return OS.str();
+  }
+
+  //Greedily select checkpoints by coverage per dynamic cost, until the
+  //estimated overhead would pass -tolerance-budget percent of the dynamic
+  //instruction count. Coverage counts executions of shadowed binops; cost
+  //adds executions of the checks. Frequencies come from BFI, so PGO
+  //profiles are used when present. Returned values and, with
+  //-tolerance-control-flow, switch conditions are checked too, so they
+  //compete for the budget like the stores.
+  void SelectCheckPoints(Function &F, CheckPointInfo &CPI, BlockFrequencyInfo &BFI, ShadowTable &ST){
+    //splat, compare, mask test and branch
+    const double CheckCost = 4;
+    double entry = BFI.getEntryFreq();
+    auto Freq = [&](Instruction *inst) {
+        return BFI.getBlockFreq(inst->getParent()).getFrequency() / entry;
+    };
+    double baseline = 0;
+    for (auto &B : F)
+        baseline += BFI.getBlockFreq(&B).getFrequency() / entry * B.size();
+
+    struct Candidate {
+        Instruction *Check;
+        SmallPtrSet<Value*, 16> Slice;
+        double Coverage;
+        double Cost;
+    };
+    const std::vector<StoreInst*> &CheckPoint = CPI.GetCheckPoints();
+    std::vector<Candidate> Cands(CheckPoint.size());
+    for (size_t i = 0; i < CheckPoint.size(); i++) {
+        Cands[i].Check = CheckPoint[i];
+        CollectSlice(CheckPoint[i], Cands[i].Slice);
+    }
+    for (auto &B : F) {
+        Value *val = NULL;
+        if (ReturnInst *ret = dyn_cast<ReturnInst>(B.getTerminator()))
+            val = ret->getReturnValue();
+        else if (SwitchInst *sw = dyn_cast<SwitchInst>(B.getTerminator()))
+            val = ST.ControlFlow ? sw->getCondition() : NULL;
+        if (!val || !(isa<BinaryOperator>(val) || isa<PHINode>(val)))
+            continue;
+        Cands.emplace_back();
+        Cands.back().Check = B.getTerminator();
+        CollectValueSlice(val, Cands.back().Slice);
+    }
+    double total = 0;
+    for (Candidate &C : Cands) {
+        C.Coverage = 0;
+        for (Value *val : C.Slice)
+            if (BinaryOperator *bin = dyn_cast<BinaryOperator>(val))
+                C.Coverage += Freq(bin);
+        C.Cost = C.Coverage + CheckCost * Freq(C.Check);
+        total += C.Coverage;
+    }
+    std::stable_sort(Cands.begin(), Cands.end(), [](const Candidate &a, const Candidate &b) {
+        return a.Coverage * b.Cost > b.Coverage * a.Cost;
+    });
+
+    ST.Selective = true;
+    double budget = baseline * OverheadBudget / 100;
+    double spent = 0, covered = 0;
+    unsigned picked = 0;
+    for (Candidate &C : Cands) {
+        //slices overlap: only count what is not shadowed yet
+        double coverage = 0;
+        for (Value *val : C.Slice)
+            if (isa<BinaryOperator>(val) && !ST.Selected.count(val))
+                coverage += Freq(cast<BinaryOperator>(val));
+        double cost = coverage + CheckCost * Freq(C.Check);
+        if (spent + cost > budget)
+            continue;
+        spent += cost;
+        covered += coverage;
+        picked++;
+        ST.Selected.insert(C.Check);
+        ST.Selected.insert(C.Slice.begin(), C.Slice.end());
+    }
+    ST.ORE->emit([&]() {
+        return OptimizationRemarkAnalysis(DEBUG_TYPE, "Budget", F.getSubprogram(), &F.getEntryBlock())
+               << "selected " << ore::NV("Selected", picked) << " of "
+               << ore::NV("CheckPoints", (unsigned)Cands.size()) << " checkpoints, coverage "
+               << ore::NV("Coverage", Percent(total ? covered / total : 1.0)) << "%, estimated overhead "
+               << ore::NV("Overhead", Percent(baseline ? spent / baseline : 0.0)) << "%";
+    });
+  }
+
+/**===================Reporting========================**/
+  //Rough cost model of the remarks: a shadow op with its operand loads or
+  //splats, and a check with its mask test, branch and recovery store.
+  const unsigned ShadowOpInsts = 3, CheckInsts = 5;
+
+  //One remark per check, at the checked instruction, so its debug location
+  //shows where protection costs. A shadow op shared by several checks is
+  //counted at the first one only.
+  void EmitCheckRemarks(ShadowTable &ST){
+    //the slices are only worth walking when someone reads the remarks
+    if (!ST.ORE->allowExtraAnalysis(DEBUG_TYPE))
+        return;
+    SmallPtrSet<Value*, 32> Counted;
+    auto Remark = [&](StringRef Name, Instruction *op, Value *val, StringRef kind, unsigned copies) {
+        SmallPtrSet<Value*, 16> Slice;
+        CollectValueSlice(val, Slice);
+        unsigned shadow_ops = 0;
+        for (Value *v : Slice)
+            if (isa<BinaryOperator>(v) && ST.Shadow.IsAdded(v) && Counted.insert(v).second)
+                shadow_ops++;
+        ST.ORE->emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, Name, op)
+                   << "checked as " << ore::NV("Kind", kind) << " with "
+                   << ore::NV("Copies", copies) << " copies, "
+                   << ore::NV("ShadowOps", shadow_ops) << " shadow ops, about "
+                   << ore::NV("AddedInsts", shadow_ops * ShadowOpInsts + CheckInsts) << " instructions added";
+        });
+    };
+    for (auto &Site : ST.Checks) {
+        CheckSite &site = Site.second;
+        StringRef kind = site.Recompute ? "recomputation" :
+                         site.Lanes->getType()->isVectorTy() ? "lanes" : "AN code";
+        Remark("CheckPoint", Site.first, site.Protected, kind, site.Copies);
+    }
+    for (auto &Red : ST.Reductions)
+        Remark("ExitCheck", Red.first, Red.first->getValueOperand(), "reduction at loop exit",
+               ST.IsANType(Red.first->getValueOperand()->getType()) ? 1 : ST.GetLanes(Red.first->getValueOperand()->getType()));
+  }
+
+/**===================Policy========================**/
+  //What ProtectFunction does to one function. The cl::opt flags give the
+  //defaults; -tolerance-policy rules, annotate("tolerance=...") and the
+  //"tolerance" function attribute refine them, in that order.
+  struct Policy {
+    bool Enabled;
+    bool DetectOnly;
+    bool Majority;
+    bool TRUMP;
+    bool ControlFlow;
+    unsigned VectorBits;//0 = widest target register
+  };
+
+  //Policy strings are comma separated: off, on, detect, recover, majority,
+  //trump, cf, width=<bits>; e.g. "majority,cf,width=256".
+  void ApplyPolicy(Policy &P, StringRef Str, Function &F){
+    SmallVector<StringRef, 4> Tokens;
+    Str.split(Tokens, ',', -1, false);
+    for (StringRef Tok : Tokens) {
+        Tok = Tok.trim();
+        unsigned bits;
+        if (Tok == "off")
+            P.Enabled = false;
+        else if (Tok == "on")
+            P.Enabled = true;
+        else if (Tok == "detect")
+            P.DetectOnly = true;
+        else if (Tok == "recover")
+            P.DetectOnly = P.Majority = false;
+        else if (Tok == "majority") {
+            P.Majority = true;
+            P.DetectOnly = false;
+        } else if (Tok == "trump")
+            P.TRUMP = true;
+        else if (Tok == "cf")
+            P.ControlFlow = true;
+        else if (Tok.startswith("width=") && !Tok.drop_front(6).getAsInteger(10, bits))
+            P.VectorBits = bits;
+        else
+            errs() << "Unknown tolerance policy '" << Tok << "' for " << F.getName() << "\n";
+    }
+  }
+
+  //Strings of the llvm.global.annotations entries on F.
+  void GetAnnotations(Function &F, SmallVectorImpl<StringRef> &Annotations){
+    GlobalVariable *GA = F.getParent()->getGlobalVariable("llvm.global.annotations");
+    if (!GA || !GA->hasInitializer())
+        return;
+    ConstantArray *Arr = dyn_cast<ConstantArray>(GA->getInitializer());
+    if (!Arr)
+        return;
+    for (Value *Op : Arr->operands()) {
+        ConstantStruct *Entry = dyn_cast<ConstantStruct>(Op);
+        if (!Entry || Entry->getNumOperands() < 2 || Entry->getOperand(0)->stripPointerCasts() != &F)
+            continue;
+        GlobalVariable *Str = dyn_cast<GlobalVariable>(Entry->getOperand(1)->stripPointerCasts());
+        if (!Str || !Str->hasInitializer())
+            continue;
+        ConstantDataArray *Data = dyn_cast<ConstantDataArray>(Str->getInitializer());
+        if (Data && Data->isCString())
+            Annotations.push_back(Data->getAsCString());
+    }
+  }
+
+  //-tolerance-policy rules; '#' starts a comment, later lines win.
+  class PolicyTable {
+    std::vector<std::pair<GlobPattern, std::string> > Rules;
+
+    public:
+    void load(StringRef Path) {
+        Rules.clear();
+        if (Path.empty())
+            return;
+        ErrorOr<std::unique_ptr<MemoryBuffer> > Buf = MemoryBuffer::getFile(Path);
+        if (!Buf) {
+            errs() << "Cannot read tolerance policy " << Path << ": " << Buf.getError().message() << "\n";
+            return;
+        }
+        SmallVector<StringRef, 32> Lines;
+        (*Buf)->getBuffer().split(Lines, '\n');
+        for (StringRef Line : Lines) {
+            Line = Line.split('#').first.trim();
+            if (Line.empty())
+                continue;
+            std::pair<StringRef, StringRef> Rule = getToken(Line);
+            Expected<GlobPattern> Pat = GlobPattern::create(Rule.first);
+            if (!Pat) {
+                errs() << "Bad function pattern in " << Path << ": " << toString(Pat.takeError()) << "\n";
+                continue;
+            }
+            Rules.push_back(std::make_pair(std::move(*Pat), Rule.second.trim().str()));
+        }
+    }
+    Policy get(Function &F) const {
+        Policy P = {true, false, CheckMajority, CheckTRUMP, ControlFlowCheck, VectorWidth};
+        for (auto &Rule : Rules)
+            if (Rule.first.match(F.getName()))
+                ApplyPolicy(P, Rule.second, F);
+        SmallVector<StringRef, 2> Annotations;
+        GetAnnotations(F, Annotations);
+        for (StringRef Str : Annotations)
+            if (Str.startswith("tolerance="))
+                ApplyPolicy(P, Str.drop_front(10), F);
+        if (F.hasFnAttribute("tolerance"))
+            ApplyPolicy(P, F.getFnAttribute("tolerance").getValueAsString(), F);
+        return P;
+    }
+  };
+
+/**===================Shadow-aware clones========================**/
+  //-tolerance-clone-budget: small hot callees get a clone that also takes
+  //the shadows of its scalar arguments and hands back the shadow of its
+  //result,
+  //  R f.shadow(args..., <N x T> arg shadows..., <N x R> *result shadow)
+  //so lane redundancy carries across the call instead of restarting from
+  //a splat of the returned scalar. The callee itself is kept for calls the
+  //clone does not fit.
+  struct ShadowClones {
+    DenseMap<Function*, Function*> Clone;//callee -> clone
+    DenseMap<Function*, Function*> Original;//clone -> callee
+  };
+
+  bool CanShadowClone(Function &F, CallGraph &CG){
+    if (F.isDeclaration() || F.isVarArg() || !IsShadowType(F.getReturnType()))
+        return false;
+    for (Argument &A : F.args())
+        if (A.hasStructRetAttr() || A.hasByValAttr())
+            return false;
+    //no direct recursion: the clone would call the callee, not itself
+    for (auto &Call : *CG[&F])
+        if (Call.second->getFunction() == &F)
+            return false;
+    return true;
+  }
+
+  Function *CreateShadowClone(Function &F, unsigned bits){
+    SmallVector<Type*, 8> Params;
+    for (Argument &A : F.args())
+        Params.push_back(A.getType());
+    for (Argument &A : F.args())
+        if (IsShadowType(A.getType()))
+            Params.push_back(VectorType::get(A.getType(), GetLanes(bits, A.getType())));
+    Type *ret_ty = F.getReturnType();
+    Params.push_back(PointerType::getUnqual(VectorType::get(ret_ty, GetLanes(bits, ret_ty))));
+    FunctionType *FTy = FunctionType::get(ret_ty, Params, false);
+    Function *NewF = Function::Create(FTy, GlobalValue::InternalLinkage, F.getName() + ".shadow", F.getParent());
+    ValueToValueMapTy VMap;
+    auto NewArg = NewF->arg_begin();
+    for (Argument &A : F.args()) {
+        NewArg->setName(A.getName());
+        VMap[&A] = &*NewArg++;
+    }
+    //names that do not clash, since a clash bumps the suffix of every later
+    //clash in NewF, and -tolerance-threads protects NewF after a round trip
+    //through bitcode, which resets it
+    for (Argument &A : F.args())
+        if (IsShadowType(A.getType())) {
+            if (A.hasName())
+                NewArg->setName(A.getName() + ".shadow");
+            ++NewArg;
+        }
+    NewArg->setName("ret.shadow");
+    SmallVector<ReturnInst*, 4> Returns;
+    CloneFunctionInto(NewF, &F, VMap, F.getSubprogram() != NULL, Returns);
+    //copied from F, but local linkage requires the default visibility
+    NewF->setVisibility(GlobalValue::DefaultVisibility);
+    return NewF;
+  }
+
+  //Clone the callees with the most calls per caller invocation for their
+  //size, weighted by block frequency, until the clones would grow the
+  //module by more than -tolerance-clone-budget percent.
+  template <typename GetPolicyFn>
+  void CreateShadowClones(Module &M, FunctionAnalysisManager &FAM, GetPolicyFn GetPolicy, ShadowClones &Clones){
+    CallGraph CG(M);
+    //in module order, so equally hot callees are cloned in module order
+    MapVector<Function*, double> Hotness;
+    unsigned module_size = 0;
+    for (Function &F : M) {
+        if (F.isDeclaration())
+            continue;
+        module_size += F.getInstructionCount();
+        BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+        double entry = BFI.getEntryFreq();
+        for (auto &Call : *CG[&F]) {
+            Function *callee = Call.second->getFunction();
+            Value *call_val = Call.first;
+            Instruction *call = dyn_cast_or_null<Instruction>(call_val);
+            if (callee && call && callee != &F)
+                Hotness[callee] += BFI.getBlockFreq(call->getParent()).getFrequency() / entry;
+        }
+    }
+    std::vector<std::pair<double, Function*> > Candidates;
+    for (auto &Hot : Hotness) {
+        Function *F = Hot.first;
+        if (CanShadowClone(*F, CG) && GetPolicy(*F).Enabled)
+            Candidates.push_back(std::make_pair(Hot.second / (F->getInstructionCount() + 1), F));
+    }
+    std::stable_sort(Candidates.begin(), Candidates.end(),
+                     [](const std::pair<double, Function*> &A, const std::pair<double, Function*> &B) {
+                         return A.first > B.first;
+                     });
+    uint64_t budget = (uint64_t)module_size * CloneBudget / 100;
+    for (auto &Cand : Candidates) {
+        Function &F = *Cand.second;
+        if (F.getInstructionCount() > budget)
+            continue;
+        budget -= F.getInstructionCount();
+        Policy P = GetPolicy(F);
+        unsigned bits = P.VectorBits ? P.VectorBits :
+                        std::max(128u, FAM.getResult<TargetIRAnalysis>(F).getRegisterBitWidth(true));
+        Function *NewF = CreateShadowClone(F, bits);
+        Clones.Clone[&F] = NewF;
+        Clones.Original[NewF] = &F;
+    }
+  }
+
+  //In a clone, the shadow parameters are the shadows of the arguments;
+  //AN-encoded arguments start from the code word of their first lane.
+  void BindCloneArgs(Function &F, ShadowTable &ST, Function &Orig){
+    IRBuilder<> builder(&*F.getEntryBlock().getFirstInsertionPt());
+    unsigned nargs = Orig.arg_size(), next = nargs;
+    for (unsigned i = 0; i < nargs; i++) {
+        Argument *A = &*(F.arg_begin() + i);
+        if (!IsShadowType(A->getType()))
+            continue;
+        Value *shadow = &*(F.arg_begin() + next++);
+        if (ST.IsANType(A->getType()))
+            shadow = CreateANEncode(builder, builder.CreateExtractElement(shadow, (uint64_t)0), ST);
+        ST.Shadow.AddPair(A, shadow);
+    }
+    ST.RetShadow = &*(F.arg_begin() + next);
+  }
+
+  //Calls to cloned callees call the clone instead, with undef argument
+  //shadows for CompleteShadowCalls to fill in; the call's shadow is read
+  //back from a slot right after it. Calls whose shadows would not fit the
+  //clone's lanes are left alone.
+  void RetargetCalls(Function &F, ShadowTable &ST, const ShadowClones &Clones){
+    std::vector<CallInst*> Calls;
+    for (Instruction &I : instructions(F))
+        if (CallInst *call = dyn_cast<CallInst>(&I))
+            if (call->getCalledFunction() && Clones.Clone.count(call->getCalledFunction()))
+                Calls.push_back(call);
+    for (CallInst *call : Calls) {
+        Function *clone = Clones.Clone.lookup(call->getCalledFunction());
+        FunctionType *FTy = clone->getFunctionType();
+        Type *ret_ty = call->getType();
+        if (ST.IsANType(ret_ty) ||
+            FTy->params().back() != PointerType::getUnqual(VectorType::get(ret_ty, ST.GetLanes(ret_ty))))
+            continue;
+        SmallVector<Value*, 8> Args(call->arg_begin(), call->arg_end());
+        unsigned call_args = Args.size();
+        bool fits = true;
+        for (Value *arg : call->arg_operands()) {
+            if (!IsShadowType(arg->getType()))
+                continue;
+            Type *shadow_ty = VectorType::get(arg->getType(), ST.GetLanes(arg->getType()));
+            fits = fits && FTy->getParamType(Args.size()) == shadow_ty;
+            Args.push_back(UndefValue::get(shadow_ty));
+        }
+        if (!fits)
+            continue;
+        IRBuilder<> builderEntry(&*F.getEntryBlock().getFirstInsertionPt());
+        AllocaInst *slot = builderEntry.CreateAlloca(cast<PointerType>(FTy->params().back())->getElementType(), NULL, "retShadow");
+        slot->setAlignment(16);
+        Args.push_back(slot);
+        IRBuilder<> builder(call);
+        CallInst *ncall = builder.CreateCall(clone, Args);
+        ncall->takeName(call);
+        ncall->setDebugLoc(call->getDebugLoc());
+        ncall->setCallingConv(call->getCallingConv());
+        IRBuilder<> builderafter(call);
+        LoadInst *shadow = builderafter.CreateLoad(slot, "Vret");
+        shadow->setAlignment(16);
+        call->replaceAllUsesWith(ncall);
+        call->eraseFromParent();
+        ST.Shadow.AddPair(ncall, shadow);
+        ST.ShadowCalls.push_back(std::make_pair(ncall, call_args));
+    }
+  }
+
+  //Fill the argument shadows of the retargeted calls, and in a clone store
+  //the shadow of each returned value for the caller.
+  void CompleteShadowCalls(Function &F, ShadowTable &ST){
+    for (auto &Call : ST.ShadowCalls) {
+        CallInst *call = Call.first;
+        unsigned nargs = Call.second, next = nargs;
+        IRBuilder<> builder(call);
+        for (unsigned i = 0; i < nargs; i++) {
+            Value *arg = call->getArgOperand(i);
+            if (IsShadowType(arg->getType()))
+                call->setArgOperand(next++, GetLaneShadow(builder, arg, ST));
+        }
+    }
+    if (!ST.RetShadow)
+        return;
+    for (BasicBlock &B : F) {
+        ReturnInst *ret = dyn_cast<ReturnInst>(B.getTerminator());
+        if (!ret || !ret->getReturnValue())
+            continue;
+        IRBuilder<> builder(ret);
+        Value *val = ret->getReturnValue(), *shadow;
+        LoadInst *ld = dyn_cast<LoadInst>(val);
+        //a slot's shadow only follows the binop results stored to it; a
+        //load used by nothing but the return was never splat into it
+        if (ld && ST.Shadow.Findpair(ld->getPointerOperand()) && !ST.Stored.count(ld->getPointerOperand()))
+            shadow = CreateSIMDInst(builder, val, val->getType(), ST.GetLanes(val->getType()), "insertRet");
+        else
+            shadow = GetLaneShadow(builder, val, ST);
+        StoreInst *store_val = builder.CreateStore(shadow, ST.RetShadow);
+        store_val->setAlignment(16);
+    }
+  }
 
+  //Protect F: shadow its binops and check its checkpoint stores. Works on
+  //-O0 IR, with slots in allocas, and on optimized SSA IR, with PHIs and
+  //values returned or stored through pointers. Shared by
+  //the legacy and the new pass manager passes. Besides F it interns
+  //constants and types in the context and adds declarations and globals
+  //to the module, so two functions of one context are never protected at
+  //the same time; ProtectInParts gives each thread a context of its own.
+  bool ProtectFunction(Function &F, CheckPointInfo &CPI, const TargetTransformInfo &TTI, const TargetLibraryInfo *TLI,
+                       OptimizationRemarkEmitter &ORE, BlockFrequencyInfo *BFI, const Policy &P, LoopInfo *LI,
+                       const ShadowClones *Clones) {
+    if (!P.Enabled)
+      return false;
+    unsigned insts_before = F.getInstructionCount();
+    ShadowTable ST;
+    ST.VectorBits = P.VectorBits;
+    ST.DetectOnly = P.DetectOnly;
+    ST.ControlFlow = P.ControlFlow;
+    ST.TLI = TLI;
+    ST.ORE = &ORE;
+    if (!ST.VectorBits) {
+      //widest vector register of the target, SSE width at least
+      ST.VectorBits = std::max(128u, TTI.getRegisterBitWidth(true));
+    }
+    if (P.TRUMP) {
+      //A must be odd to be invertible mod 2^64
+      ST.ANConstant = TRUMPConstant;
+      if (ST.ANConstant < 3 || ST.ANConstant % 2 == 0) {
+          errs() << "Invalid AN constant " << TRUMPConstant << ", using 3\n";
+          ST.ANConstant = 3;
       }
-      //Create Fault Recovery
-      //Delete map value after insert successfully
-      InsertCheck(F,check_map,recovery_map1,recovery_map);
-      
-      if(CheckMajority)
-      {
-        Test();
+      ST.ANInverse = GetANInverse(ST.ANConstant);
+    }
+    std::vector<Value*> RecoveryPoint;
+    const std::vector<StoreInst*> &CheckPoint = CPI.GetCheckPoints();
+    if(Clones) {
+      if (Function *Orig = Clones->Original.lookup(&F))
+        BindCloneArgs(F, ST, *Orig);
+      RetargetCalls(F, ST, *Clones);
+    }
+    if(OverheadBudget && BFI)
+      SelectCheckPoints(F, CPI, *BFI, ST);
+    if(LI)
+      AnalyzeLoops(F, ST, CPI, *LI);
+    if(PackOps)
+      FindPackPairs(F, ST, CPI);
+    //walk a snapshot of the original instructions, so code inserted for
+    //one instruction is never visited again
+    std::vector<Instruction*> Worklist;
+    for (auto &B : F)
+      for (auto &I : B)
+        Worklist.push_back(&I);
+    SmallVector<CmpInst*, 16> Cmps;
+    if(P.ControlFlow)
+      CollectCompares(F, Cmps);
+    //one recovery slot per checkpoint store to a local slot, at the top of
+    //the entry block so it dominates every check, whether or not the
+    //function has other allocas. Stores through pointers, as in SSA form,
+    //recover through a PHI in front of the store instead.
+    IRBuilder<> builderEntry(&*F.getEntryBlock().getFirstInsertionPt());
+    for (StoreInst *st : CheckPoint) {
+      if (!isa<AllocaInst>(st->getPointerOperand())) {
+        RecoveryPoint.push_back(NULL);
+        continue;
       }
-      //replace recovery value to store
-      ReplaceRecoveryVal(F, recovery_map1);
-     
-      //errs()<<"Show LLVM IR:\n";
-      /*
-      for (auto &B : F) {
-            B.dump();
-            for (auto &I : B) {
-              //I.dump();
+      Type *val_t = st->getValueOperand()->getType();
+      AllocaInst *recovery = builderEntry.CreateAlloca(val_t, nullptr, "Recovery");
+      recovery->setAlignment(val_t->getPrimitiveSizeInBits() / 8);
+      ST.RecoveryAllocas++;
+      RecoveryPoint.push_back(recovery);
+    }
+    //tolerance
+    for (Instruction *inst : Worklist) {
+      if (auto *op = dyn_cast<AllocaInst>(inst)) {
+          if(!ST.IsSelected(op))
+              continue;
+          IRBuilder<> builder(op);
+          Type* scalar_t= op->getAllocatedType();//not pointer
+          if(ST.IsANType(scalar_t)){
+              auto allocaAN = builder.CreateAlloca(builder.getInt64Ty(),nullptr,"allocaAN");
+              allocaAN->setAlignment(8);
+              ST.Shadow.AddPair(op,allocaAN);
+          }else if(scalar_t->isIntegerTy()||scalar_t->isFloatTy()||scalar_t->isDoubleTy()){
+              auto allocaVec = builder.CreateAlloca(VectorType::get(scalar_t, ST.GetLanes(scalar_t)),nullptr,"allocaVec");
+              allocaVec->setAlignment(16);
+              ST.Shadow.AddPair(op,allocaVec);
+          }
+      }
+      else if (StoreInst *op = dyn_cast<StoreInst>(inst)) {//find store constant to allocainst and store same value to vector
+          IRBuilder<> builder(op);
+          Value* lhs = op->getOperand(0);
+          Value* rhs = op->getOperand(1);
+          if(isa<Constant>(lhs) && ST.Shadow.Findpair(rhs)){
+              Value *vec = ST.Shadow.GetVector(rhs);
+              Constant* c = cast<Constant>(lhs);
+              Type* op_type = cast<AllocaInst>(rhs)->getAllocatedType();
+              //only int, float and double slots have shadows
+              if(ST.IsANType(op_type))
+                  builder.CreateStore(CreateANEncode(builder, c, ST),vec);
+              else
+                  builder.CreateStore(ConstantVector::getSplat(ST.GetLanes(op_type), c),vec);
+          }else if(isa<Argument>(lhs) && ST.Shadow.IsAdded(lhs) && ST.Shadow.Findpair(rhs)){
+              //shadow-aware clone: the argument slot starts from the
+              //caller's shadow, and keeps it if nothing else stores there
+              StoreInst *store_val = builder.CreateStore(ST.Shadow.GetVector(lhs), ST.Shadow.GetVector(rhs));
+              store_val->setAlignment(ST.IsANType(lhs->getType()) ? 8 : 16);
+              unsigned stores = 0;
+              for (User *user : rhs->users())
+                  if (isa<StoreInst>(user))
+                      stores++;
+              if (stores == 1)
+                  ST.Stored.insert(rhs);
+          }
+      }
+      //Find load instruction & create vector after loadinst
+      else if (auto *op = dyn_cast<LoadInst>(inst)) {
+          bool VecFlag=false;//if load for binop, a cast or call shadow, or a checked compare
+          for (User *user : op->users())
+              if(isa<BinaryOperator>(user) || isa<CastInst>(user) || isa<CallInst>(user) ||
+                 (ST.ControlFlow && isa<CmpInst>(user)))
+                  VecFlag=true;
+          Value* loadinst_ptr=op->getPointerOperand();
+          Type* load_ty= op->getType();
+          //check if vec have already saved value, if not create insert element
+          if(VecFlag && !ST.Stored.count(loadinst_ptr) && ST.Shadow.Findpair(loadinst_ptr)){
+              //loop-aware: splat once in the preheader instead of per iteration
+              Loop *L = LI ? GetSplatLoop(op, ST, *LI) : NULL;
+              if(L && !ST.Hoisted.insert(std::make_pair(loadinst_ptr, L)).second)
+                  continue;
+              IRBuilder<> builderafter(L ? L->getLoopPreheader()->getTerminator() : op->getNextNode());
+              Value* src = L ? builderafter.CreateLoad(loadinst_ptr) : op;
+              bool an = ST.IsANType(load_ty);
+              Value* val = an ? CreateANEncode(builderafter,src,ST)
+                              : CreateSIMDInst(builderafter,src,load_ty,ST.GetLanes(load_ty),"insertElmt");
+              //create store into vector
+              StoreInst* store_val=builderafter.CreateStore(val,ST.Shadow.GetVector(loadinst_ptr));
+              store_val->setAlignment(an ? 8 : 16);
           }
+      }
+      //SSA values meet in PHIs, and so do their shadows
+      else if (auto *op = dyn_cast<PHINode>(inst)) {
+          if(ST.IsSelected(op))
+              CreateShadowPhi(op, ST);
+      }
+      //Find operator to neon duplication
+      else if (auto *op = dyn_cast<BinaryOperator>(inst)) {
+          if(ST.IsSelected(op))
+              VectorizeBinOp(op, ST, CPI, RecoveryPoint);
+      }
+    }
+    CompleteShadowCalls(F, ST);
+    CompleteShadowPhis(ST);
+    if(P.ControlFlow)
+      InsertBlockSignatures(F, ST);
+    //Create Fault Recovery
+    //Delete map value after insert successfully
+    if(BatchChecks)
+      InsertBatchedChecks(F, ST, P.Majority ? CreateMajorityValue : CreateRecoveryValue);
+    else if(P.Majority)
+      InsertMajority(ST);
+    else
+      InsertCheck(ST);
+    InsertExitChecks(ST, P.Majority ? CreateMajorityValue : CreateRecoveryValue);
+    //replace recovery value to store
+    if(!BatchChecks && !P.DetectOnly)
+      ReplaceRecoveryVal(ST);
+    if(P.ControlFlow)
+      ProtectCompares(F, ST, Cmps);
+    if(SSAShadow)
+      PromoteShadows(F, ST, RecoveryPoint);
+
+    EmitCheckRemarks(ST);
+    unsigned added = F.getInstructionCount() - insts_before;
+    ORE.emit([&]() {
+        return OptimizationRemark(DEBUG_TYPE, "Protected", F.getSubprogram(), &F.getEntryBlock())
+               << "inserted " << ore::NV("Checks", ST.RecoveryChecks) << " checks for "
+               << ore::NV("CheckPoints", (unsigned)CheckPoint.size()) << " checkpoints, "
+               << ore::NV("AddedInsts", added) << " instructions added to "
+               << ore::NV("Insts", insts_before);
+    });
+    NumFunctions++;
+    NumCheckPoints += CheckPoint.size();
+    NumChecks += ST.RecoveryChecks;
+    NumRecoverySlots += ST.RecoveryAllocas;
+    NumRecovered += ST.RecoveryNum;
+    NumAddedInsts += added;
+    return true;
+  }
+
+/**===================Fault injection========================**/
+  //Fault injection for the campaign driver in bench/:
+  //  opt -tolerance-fi-sites -tolerance -tolerance-inject
+  //The sites pass tags the integer and FP results of the original binops,
+  //loads and casts with !tolerance.fi before protection, so the inject
+  //pass never hits shadow code. After protection each tagged result goes
+  //through
+  //  uint64_t __tolerance_inject(uint64_t bits, uint32_t width);
+  //of runtime/tolerance_fi.c, which flips one bit of the chosen dynamic
+  //result.
+  bool IsInjectSite(Instruction &I){
+    if (!isa<BinaryOperator>(I) && !isa<LoadInst>(I) && !isa<CastInst>(I))
+        return false;
+    Type *ty = I.getType();
+    return ty->isFloatTy() || ty->isDoubleTy() ||
+           (ty->isIntegerTy() && ty->getIntegerBitWidth() <= 64);
+  }
+
+  bool TagInjectSites(Function &F){
+    bool Changed = false;
+    for (Instruction &I : instructions(F)) {
+        if (!IsInjectSite(I))
+            continue;
+        I.setMetadata("tolerance.fi", MDNode::get(F.getContext(), None));
+        Changed = true;
+    }
+    return Changed;
+  }
+
+  bool InjectFaults(Function &F){
+    std::vector<Instruction*> Sites;
+    for (Instruction &I : instructions(F))
+        if (I.getMetadata("tolerance.fi"))
+            Sites.push_back(&I);
+    if (Sites.empty())
+        return false;
+    LLVMContext &Ctx = F.getContext();
+    Constant *hook = F.getParent()->getOrInsertFunction("__tolerance_inject", Type::getInt64Ty(Ctx),
+                                                        Type::getInt64Ty(Ctx), Type::getInt32Ty(Ctx));
+    for (Instruction *I : Sites) {
+        I->setMetadata("tolerance.fi", NULL);
+        Type *ty = I->getType();
+        unsigned width = ty->getPrimitiveSizeInBits();
+        IRBuilder<> builder(I->getNextNode());
+        Value *bits = I;
+        if (!ty->isIntegerTy())
+            bits = builder.CreateBitCast(bits, builder.getIntNTy(width));
+        if (width < 64)
+            bits = builder.CreateZExt(bits, builder.getInt64Ty());
+        CallInst *call = builder.CreateCall(hook, {bits, builder.getInt32(width)});
+        Value *res = builder.CreateTrunc(call, builder.getIntNTy(width));
+        res = builder.CreateBitCast(res, ty, "injected");
+        //every use but the instruction reading I for the hook sees the fault
+        Instruction *reader = bits == I ? call : cast<Instruction>(I->getNextNode());
+        I->replaceAllUsesWith(res);
+        reader->setOperand(0, I);
+    }
+    return true;
+  }
+
+  struct ToleranceFISites : public FunctionPass {
+    static char ID;
+    ToleranceFISites() : FunctionPass(ID) {}
+    virtual bool runOnFunction(Function &F) {
+        return TagInjectSites(F);
+    }
+  };
+  struct ToleranceInject : public FunctionPass {
+    static char ID;
+    ToleranceInject() : FunctionPass(ID) {}
+    virtual bool runOnFunction(Function &F) {
+        return InjectFaults(F);
+    }
+  };
+
+  struct TolerancePass : public FunctionPass {
+    static char ID;
+    PolicyTable Policies;
+    TolerancePass() : FunctionPass(ID) {}
+    bool doInitialization(Module &M) override {
+        Policies.load(PolicyFile);
+        return false;
+    }
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+        AU.addRequired<ToleranceCheckPoints>();
+        AU.addRequired<TargetTransformInfoWrapperPass>();
+        AU.addRequired<TargetLibraryInfoWrapperPass>();
+        AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+        if (OverheadBudget)
+            AU.addRequired<BlockFrequencyInfoWrapperPass>();
+        if (LoopAware)
+            AU.addRequired<LoopInfoWrapperPass>();
+    }
+    virtual bool runOnFunction(Function &F) {
+        CheckPointInfo &CPI = getAnalysis<ToleranceCheckPoints>().GetInfo();
+        const TargetTransformInfo &TTI = getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+        BlockFrequencyInfo *BFI = NULL;
+        if (OverheadBudget)
+            BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+        LoopInfo *LI = NULL;
+        if (LoopAware)
+            LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+        const TargetLibraryInfo &TLI = getAnalysis<TargetLibraryInfoWrapperPass>().getTLI();
+        OptimizationRemarkEmitter &ORE = getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+        return ProtectFunction(F, CPI, TTI, &TLI, ORE, BFI, Policies.get(F), LI, NULL);
+    }
+  };
+
+/**===================New pass manager========================**/
+  struct ToleranceCheckPointAnalysis : public AnalysisInfoMixin<ToleranceCheckPointAnalysis> {
+    typedef CheckPointInfo Result;
+    Result run(Function &F, FunctionAnalysisManager &) {
+        CheckPointInfo CPI;
+        CPI.analyze(F);
+        return CPI;
+    }
+    static AnalysisKey Key;
+  };
+  AnalysisKey ToleranceCheckPointAnalysis::Key;
+
+  //opt -passes='print<tolerance-checkpoints>'
+  struct ToleranceCheckPointPrinter : public PassInfoMixin<ToleranceCheckPointPrinter> {
+    raw_ostream &OS;
+    explicit ToleranceCheckPointPrinter(raw_ostream &OS) : OS(OS) {}
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        FAM.getResult<ToleranceCheckPointAnalysis>(F).print(OS);
+        return PreservedAnalyses::all();
+    }
+  };
+
+  //opt -passes=tolerance
+  struct ToleranceNewPass : public PassInfoMixin<ToleranceNewPass> {
+    PolicyTable Policies;
+    ToleranceNewPass() { Policies.load(PolicyFile); }
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        CheckPointInfo &CPI = FAM.getResult<ToleranceCheckPointAnalysis>(F);
+        const TargetTransformInfo &TTI = FAM.getResult<TargetIRAnalysis>(F);
+        BlockFrequencyInfo *BFI = OverheadBudget ? &FAM.getResult<BlockFrequencyAnalysis>(F) : NULL;
+        LoopInfo *LI = LoopAware ? &FAM.getResult<LoopAnalysis>(F) : NULL;
+        const TargetLibraryInfo &TLI = FAM.getResult<TargetLibraryAnalysis>(F);
+        OptimizationRemarkEmitter &ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
+        if (!ProtectFunction(F, CPI, TTI, &TLI, ORE, BFI, Policies.get(F), LI, NULL))
+            return PreservedAnalyses::all();
+        return PreservedAnalyses::none();
+    }
+  };
+
+  //opt -passes='tolerance-fi-sites,tolerance,tolerance-inject'
+  struct ToleranceFISitesNewPass : public PassInfoMixin<ToleranceFISitesNewPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        return TagInjectSites(F) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+  };
+  struct ToleranceInjectNewPass : public PassInfoMixin<ToleranceInjectNewPass> {
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        return InjectFaults(F) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+  };
+
+/**===================Parallel protection========================**/
+  //-tolerance-threads: the module is protected in parts, one per pool
+  //task. Every task loads its own functions from the bitcode of the module
+  //into an LLVMContext of its own, since ProtectFunction changes the
+  //context and the module. The protected functions and the globals they
+  //made are moved back part by part.
+  struct ModulePart {
+    std::vector<std::string> Funcs;
+    std::vector<Policy> Policies;
+    std::vector<const TargetLibraryInfo*> TLIs;
+    //the part after protection
+    SmallString<0> Bitcode;
+    //which functions changed, and the declarations and globals made, in
+    //the order they were made
+    std::vector<bool> Changed;
+    std::vector<std::string> NewFuncs, NewGlobals;
+    //the distinct metadata of Funcs, which the parts would duplicate, and
+    //the named metadata listing their copies
+    std::vector<MDNode*> Distinct;
+    std::string DistinctList;
+  };
+
+  void CollectDistinct(Metadata *MD, SmallPtrSetImpl<Metadata*> &Seen, std::vector<MDNode*> &Distinct){
+    MDNode *N = dyn_cast_or_null<MDNode>(MD);
+    if (!N || !Seen.insert(N).second)
+        return;
+    if (N->isDistinct())
+        Distinct.push_back(N);
+    for (const MDOperand &Op : N->operands())
+        CollectDistinct(Op, Seen, Distinct);
+  }
+  void CollectDistinct(Function &F, SmallPtrSetImpl<Metadata*> &Seen, std::vector<MDNode*> &Distinct){
+    SmallVector<std::pair<unsigned, MDNode*>, 4> MDs;
+    F.getAllMetadata(MDs);
+    for (auto &MD : MDs)
+        CollectDistinct(MD.second, Seen, Distinct);
+    for (Instruction &I : instructions(F)) {
+        MDs.clear();
+        I.getAllMetadata(MDs);
+        for (auto &MD : MDs)
+            CollectDistinct(MD.second, Seen, Distinct);
+        for (Value *Op : I.operands())
+            if (MetadataAsValue *MV = dyn_cast<MetadataAsValue>(Op))
+                CollectDistinct(MV->getMetadata(), Seen, Distinct);
+    }
+  }
+
+  //Move the body of F into a new function in its place, as IRMover does
+  //with the functions of a part. The writer emits the names of a function
+  //in the order of its symbol table, which depends on how it was filled.
+  void RenewFunction(Function &F){
+    Function *NewF = Function::Create(F.getFunctionType(), F.getLinkage());
+    F.getParent()->getFunctionList().insert(F.getIterator(), NewF);
+    NewF->copyAttributesFrom(&F);
+    NewF->setComdat(F.getComdat());
+    NewF->copyMetadata(&F, 0);
+    NewF->stealArgumentListFrom(F);
+    NewF->getBasicBlockList().splice(NewF->end(), F.getBasicBlockList());
+    NewF->takeName(&F);
+    F.replaceAllUsesWith(NewF);
+    F.eraseFromParent();
+  }
+
+  //Sort every use-list by where the users are in M. Protecting in parts
+  //makes the uses in another order than protecting function by function,
+  //and opt writes the use-list order into the bitcode.
+  void NumberUses(User *U, DenseMap<const Use*, unsigned> &Pos, SetVector<Value*> &Used){
+    for (Use &Op : U->operands()) {
+        unsigned pos = Pos.size();
+        Pos[&Op] = pos;
+        if (Used.insert(Op.get()) && isa<Constant>(Op.get()) && !isa<GlobalValue>(Op.get()))
+            NumberUses(cast<User>(Op.get()), Pos, Used);
+    }
+  }
+  void SortUseLists(Module &M){
+    DenseMap<const Use*, unsigned> Pos;
+    SetVector<Value*> Used;
+    for (GlobalVariable &GV : M.globals())
+        NumberUses(&GV, Pos, Used);
+    for (GlobalAlias &GA : M.aliases())
+        NumberUses(&GA, Pos, Used);
+    for (Function &F : M) {
+        NumberUses(&F, Pos, Used);
+        for (Instruction &I : instructions(F))
+            NumberUses(&I, Pos, Used);
+    }
+    for (Value *V : Used) {
+        if (Constant *C = dyn_cast<Constant>(V))
+            C->removeDeadConstantUsers();
+        if (!V->hasNUsesOrMore(2))
+            continue;
+        V->sortUseList([&](const Use &L, const Use &R) { return Pos.lookup(&L) < Pos.lookup(&R); });
+    }
+  }
+
+  //Runs on a pool thread. Of the module's state it only reads the TLIs.
+  void ProtectPart(ModulePart &Part, StringRef Bitcode, ArrayRef<std::pair<std::string, std::string> > CloneNames,
+                   bool DiscardNames){
+    LLVMContext Ctx;
+    Ctx.setDiscardValueNames(DiscardNames);
+    Expected<std::unique_ptr<Module> > PartOrErr =
+        getLazyBitcodeModule(MemoryBufferRef(Bitcode, "tolerance-part"), Ctx);
+    if (!PartOrErr)
+        report_fatal_error("Cannot read tolerance part: " + Twine(toString(PartOrErr.takeError())));
+    Module &M = **PartOrErr;
+    //Only the bodies of the part are loaded, and the rest of the module is
+    //declared; of it only what the part uses and the clones with their
+    //callees are kept. A runtime hook or intrinsic declared again is linked
+    //to the module's.
+    StringSet<> Defined, Keep;
+    for (std::string &Name : Part.Funcs)
+        Defined.insert(Name);
+    for (auto &Names : CloneNames) {
+        Keep.insert(Names.first);
+        Keep.insert(Names.second);
+    }
+    for (Function &F : M)
+        if (!Defined.count(F.getName()))
+            F.deleteBody();
+    if (Error E = M.materializeAll())
+        report_fatal_error("Cannot read tolerance part: " + Twine(toString(std::move(E))));
+    for (GlobalVariable &GV : M.globals()) {
+        GV.setInitializer(NULL);
+        GV.setComdat(NULL);
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+    for (auto GA = M.alias_begin(); GA != M.alias_end();) {
+        GlobalAlias &Alias = *GA++;
+        GlobalValue *Decl;
+        if (FunctionType *FTy = dyn_cast<FunctionType>(Alias.getValueType()))
+            Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &M);
+        else
+            Decl = new GlobalVariable(M, Alias.getValueType(), false, GlobalValue::ExternalLinkage, NULL);
+        Decl->takeName(&Alias);
+        Alias.replaceAllUsesWith(ConstantExpr::getPointerBitCastOrAddrSpaceCast(Decl, Alias.getType()));
+        Alias.eraseFromParent();
+    }
+    for (auto F = M.begin(); F != M.end();) {
+        Function &Decl = *F++;
+        if (Decl.isDeclaration() && Decl.use_empty() && !Keep.count(Decl.getName()))
+            Decl.eraseFromParent();
+    }
+    for (auto GV = M.global_begin(); GV != M.global_end();) {
+        GlobalVariable &Decl = *GV++;
+        Decl.removeDeadConstantUsers();
+        if (Decl.use_empty())
+            Decl.eraseFromParent();
+    }
+    //would be appended to the module's again
+    M.setModuleInlineAsm("");
+    for (auto NMD = M.named_metadata_begin(); NMD != M.named_metadata_end();) {
+        NamedMDNode &Node = *NMD++;
+        if (Node.getName() != Part.DistinctList)
+            M.eraseNamedMetadata(&Node);
+    }
+    ShadowClones Clones;
+    for (auto &Names : CloneNames) {
+        Function *Callee = M.getFunction(Names.first), *Clone = M.getFunction(Names.second);
+        Clones.Clone[Callee] = Clone;
+        Clones.Original[Clone] = Callee;
+    }
+    FunctionAnalysisManager FAM;
+    FAM.registerPass([] { return ToleranceCheckPointAnalysis(); });
+    PassBuilder().registerFunctionAnalyses(FAM);
+    size_t funcs = M.size(), globals = M.global_size();
+    for (size_t i = 0; i < Part.Funcs.size(); i++) {
+        Function &F = *M.getFunction(Part.Funcs[i]);
+        CheckPointInfo &CPI = FAM.getResult<ToleranceCheckPointAnalysis>(F);
+        BlockFrequencyInfo *BFI = OverheadBudget ? &FAM.getResult<BlockFrequencyAnalysis>(F) : NULL;
+        LoopInfo *LI = LoopAware ? &FAM.getResult<LoopAnalysis>(F) : NULL;
+        bool changed = ProtectFunction(F, CPI, FAM.getResult<TargetIRAnalysis>(F), Part.TLIs[i],
+                                       FAM.getResult<OptimizationRemarkEmitterAnalysis>(F), BFI, Part.Policies[i],
+                                       LI, &Clones);
+        if (changed)
+            FAM.invalidate(F, PreservedAnalyses::none());
+        Part.Changed.push_back(changed);
+    }
+    for (Function &F : make_range(std::next(M.begin(), funcs), M.end()))
+        Part.NewFuncs.push_back(F.getName().str());
+    for (GlobalVariable &GV : make_range(std::next(M.global_begin(), globals), M.global_end()))
+        Part.NewGlobals.push_back(GV.getName().str());
+    raw_svector_ostream OS(Part.Bitcode);
+    WriteBitcodeToFile(M, OS);
+  }
+
+  //Remarks only reach the module's own context, and debug info, ifuncs
+  //and block addresses do not survive the split, so such modules are
+  //protected serially.
+  bool CanProtectInParts(Module &M){
+    LLVMContext &Ctx = M.getContext();
+    if (Ctx.getDiagHandlerPtr()->isAnyRemarkEnabled() || Ctx.getDiagnosticsOutputFile())
+        return false;
+    if (M.getNamedMetadata("llvm.dbg.cu") || !M.ifunc_empty())
+        return false;
+    for (Function &F : M)
+        for (BasicBlock &B : F)
+            if (B.hasAddressTaken())
+                return false;
+    return true;
+  }
+
+  //Protect Funcs on a pool of threads, with the same result as protecting
+  //them one after another: the parts are contiguous runs of Funcs, and
+  //moving them back in order makes the declarations and globals in the
+  //order the serial walk makes them in. Their names do not depend on the
+  //order, see GetFaultFuncName.
+  template <typename GetPolicyFn>
+  bool ProtectInParts(Module &M, FunctionAnalysisManager &FAM, ArrayRef<Function*> Funcs, GetPolicyFn GetPolicy,
+                      const ShadowClones &Clones, unsigned threads){
+    //A part refers to what it does not define by name, so unnamed values
+    //get a name and local ones external linkage until the parts are back.
+    struct SavedValue {
+        std::string Name;
+        GlobalValue::LinkageTypes Linkage;
+        bool DSOLocal;
+        bool Unnamed;
+    };
+    std::vector<SavedValue> Saved;
+    for (GlobalValue &GV : M.global_values()) {
+        bool unnamed = !GV.hasName();
+        if (unnamed)
+            GV.setName("tolerance.unnamed");
+        Saved.push_back({GV.getName().str(), GV.getLinkage(), GV.isDSOLocal(), unnamed});
+        if (GV.hasLocalLinkage())
+            GV.setLinkage(GlobalValue::ExternalLinkage);
+    }
+    std::vector<std::string> FuncOrder, GlobalOrder;
+    StringSet<> Made;
+    for (GlobalValue &GV : M.global_values())
+        Made.insert(GV.getName());
+    for (Function &F : M)
+        FuncOrder.push_back(F.getName().str());
+    for (GlobalVariable &GV : M.globals())
+        GlobalOrder.push_back(GV.getName().str());
+    std::vector<std::pair<std::string, std::string> > CloneNames;
+    for (auto &Clone : Clones.Clone)
+        CloneNames.push_back(std::make_pair(Clone.first->getName().str(), Clone.second->getName().str()));
+
+    //contiguous parts of about the same size, one per thread, since every
+    //part reads the whole module
+    uint64_t total = 0, done = 0;
+    for (Function *F : Funcs)
+        total += F->getInstructionCount();
+    std::vector<ModulePart> Parts(std::min<size_t>(Funcs.size(), threads));
+    for (Function *F : Funcs) {
+        ModulePart &Part = Parts[done * Parts.size() / (total + 1)];
+        done += F->getInstructionCount();
+        Policy P = GetPolicy(*F);
+        if (!P.Enabled)
+            continue;
+        if (!P.VectorBits)
+            P.VectorBits = std::max(128u, FAM.getResult<TargetIRAnalysis>(*F).getRegisterBitWidth(true));
+        Part.Funcs.push_back(F->getName().str());
+        Part.Policies.push_back(P);
+        Part.TLIs.push_back(&FAM.getResult<TargetLibraryAnalysis>(*F));
+    }
+    //every part keeps a list of the copies of its distinct metadata, to
+    //map them back
+    for (size_t i = 0; i < Parts.size(); i++) {
+        ModulePart &Part = Parts[i];
+        SmallPtrSet<Metadata*, 32> Seen;
+        for (std::string &Name : Part.Funcs)
+            CollectDistinct(*M.getFunction(Name), Seen, Part.Distinct);
+        Part.DistinctList = "tolerance.distinct." + std::to_string(i);
+        NamedMDNode *List = M.getOrInsertNamedMetadata(Part.DistinctList);
+        for (MDNode *N : Part.Distinct)
+            List->addOperand(N);
+    }
+    //the use-lists as they are, since ProtectFunction walks users
+    SmallString<0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(M, OS, true);
+    for (ModulePart &Part : Parts)
+        M.eraseNamedMetadata(M.getNamedMetadata(Part.DistinctList));
+    {
+        ThreadPool Pool(threads);
+        bool discard = M.getContext().shouldDiscardValueNames();
+        for (ModulePart &Part : Parts)
+            if (!Part.Funcs.empty())
+                Pool.async([&Part, &Bitcode, &CloneNames, discard] {
+                    ProtectPart(Part, Bitcode.str(), CloneNames, discard);
+                });
+        Pool.wait();
+    }
+
+    bool Changed = false;
+    IRMover Mover(M);
+    std::vector<std::string> NewFuncs, NewGlobals;
+    for (ModulePart &Part : Parts) {
+        if (Part.Funcs.empty())
+            continue;
+        Expected<std::unique_ptr<Module> > PartOrErr =
+            parseBitcodeFile(MemoryBufferRef(Part.Bitcode.str(), "tolerance-part"), M.getContext());
+        if (!PartOrErr)
+            report_fatal_error("Cannot read tolerance part: " + Twine(toString(PartOrErr.takeError())));
+        std::vector<GlobalValue*> Values;
+        std::vector<std::string> Moved;
+        for (size_t i = 0; i < Part.Funcs.size(); i++) {
+            if (!Part.Changed[i])
+                continue;
+            Function *F = M.getFunction(Part.Funcs[i]);
+            FAM.clear(*F, F->getName());
+            F->deleteBody();
+            Values.push_back((*PartOrErr)->getFunction(Part.Funcs[i]));
+            Moved.push_back(Part.Funcs[i]);
+            Changed = true;
+        }
+        for (std::string &Name : Part.NewGlobals) {
+            Values.push_back((*PartOrErr)->getNamedValue(Name));
+            if (Made.insert(Name).second)
+                NewGlobals.push_back(Name);
+        }
+        for (std::string &Name : Part.NewFuncs)
+            if (Made.insert(Name).second)
+                NewFuncs.push_back(Name);
+        if (Error E = Mover.move(std::move(*PartOrErr), Values, [](GlobalValue &, IRMover::ValueAdder) {}, false))
+            report_fatal_error("Cannot move tolerance part back: " + Twine(toString(std::move(E))));
+        NamedMDNode *List = M.getNamedMetadata(Part.DistinctList);
+        ValueToValueMapTy VMap;
+        for (unsigned i = 0; i < Part.Distinct.size(); i++)
+            VMap.MD()[List->getOperand(i)].reset(Part.Distinct[i]);
+        M.eraseNamedMetadata(List);
+        for (std::string &Name : Moved) {
+            Function *F = M.getFunction(Name);
+            SmallVector<std::pair<unsigned, MDNode*>, 4> MDs;
+            F->getAllMetadata(MDs);
+            for (auto &MD : MDs)
+                F->setMetadata(MD.first, MapMetadata(MD.second, VMap, RF_IgnoreMissingLocals));
+            for (Instruction &I : instructions(F))
+                RemapInstruction(&I, VMap, RF_IgnoreMissingLocals);
         }
-        */
-        /*
-      errs()<<"Vector Map:\n";
-      PrintMap(&vec_map);
-      errs()<<"Check Map:\n";
-      PrintMap(&check_map);
-      errs()<<"Recovery Map:\n";
-      PrintMap(&recovery_map);
-      errs()<<"Recovery Map1:\n";
-      PrintMap(&recovery_map1);
-      */
-      //errs()<<"check point size:"<<CheckPoint.size()<<"\n";
-      /*errs()<<"recovery_alloca:"<<recovery_alloca<<"\n";
-      errs()<<"recovery_inst:"<<recovery_inst<<"\n";
-      errs()<<"recovery_check:"<<recovery_check<<"\n";
-      errs()<<"recovery_num:"<<recovery_num<<"\n";
-      errs()<<"All_check:"<<All_check.size()<<"\n";
-      for(int i=0; i<All_check.size(); i++) errs()<<i<<": "<<*All_check[i]<<"\n";
-      errs()<<"Real_check:"<<Real_check.size()<<"\n";
-      for(int i=0; i<Real_check.size(); i++) errs()<<i<<": "<<*Real_check[i]<<"\n";*/
-      //PrintMap(&check_map);
-      errs()<<"recovery_num:"<<recovery_num<<"\n";
-      return true;
+    }
+
+    //the moved functions were appended, and IRMover moves the globals a part
+    //refers to to the end, put everything back in order
+    Module::FunctionListType &FL = M.getFunctionList();
+    for (std::string &Name : FuncOrder)
+        FL.splice(FL.end(), FL, M.getFunction(Name)->getIterator());
+    for (std::string &Name : NewFuncs)
+        FL.splice(FL.end(), FL, M.getFunction(Name)->getIterator());
+    Module::GlobalListType &GL = M.getGlobalList();
+    for (std::string &Name : GlobalOrder)
+        GL.splice(GL.end(), GL, M.getGlobalVariable(Name, true)->getIterator());
+    for (std::string &Name : NewGlobals)
+        GL.splice(GL.end(), GL, M.getGlobalVariable(Name, true)->getIterator());
+    for (SavedValue &S : Saved) {
+        GlobalValue *GV = M.getNamedValue(S.Name);
+        GV->setLinkage(S.Linkage);
+        GV->setDSOLocal(S.DSOLocal);
+        if (S.Unnamed)
+            GV->setName("");
+    }
+    return Changed;
+  }
+
+  //opt -passes=tolerance-module: protects the functions in module order,
+  //with the same code as -passes=tolerance, on -tolerance-threads threads.
+  //The protected functions are renewed and the use-lists sorted, so the
+  //output does not depend on the number of threads. Only this pass sees the whole call graph, so it also builds
+  //the -tolerance-clone-budget clones, which follow the policy of their
+  //callee.
+  struct ToleranceModulePass : public PassInfoMixin<ToleranceModulePass> {
+    PolicyTable Policies;
+    ToleranceModulePass() { Policies.load(PolicyFile); }
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+        ShadowClones Clones;
+        auto GetPolicy = [&](Function &F) {
+            Function *Orig = Clones.Original.lookup(&F);
+            return Policies.get(Orig ? *Orig : F);
+        };
+        if (CloneBudget)
+            CreateShadowClones(M, FAM, GetPolicy, Clones);
+        //the rewrite declares runtime functions, so walk a snapshot
+        std::vector<Function*> Funcs;
+        for (Function &F : M)
+            if (!F.isDeclaration())
+                Funcs.push_back(&F);
+        unsigned threads = Threads ? Threads : hardware_concurrency();
+        if (threads > 1 && Funcs.size() > 1 && CanProtectInParts(M)) {
+            if (!ProtectInParts(M, FAM, Funcs, GetPolicy, Clones, threads))
+                return PreservedAnalyses::all();
+            SortUseLists(M);
+            return PreservedAnalyses::none();
+        }
+        std::vector<Function*> Changed;
+        for (Function *Fn : Funcs) {
+            Function &F = *Fn;
+            CheckPointInfo &CPI = FAM.getResult<ToleranceCheckPointAnalysis>(F);
+            BlockFrequencyInfo *BFI = OverheadBudget ? &FAM.getResult<BlockFrequencyAnalysis>(F) : NULL;
+            LoopInfo *LI = LoopAware ? &FAM.getResult<LoopAnalysis>(F) : NULL;
+            if (!ProtectFunction(F, CPI, FAM.getResult<TargetIRAnalysis>(F), &FAM.getResult<TargetLibraryAnalysis>(F),
+                                 FAM.getResult<OptimizationRemarkEmitterAnalysis>(F), BFI, GetPolicy(F), LI, &Clones))
+                continue;
+            FAM.invalidate(F, PreservedAnalyses::none());
+            Changed.push_back(&F);
+        }
+        if (Changed.empty())
+            return PreservedAnalyses::all();
+        for (Function *F : Changed) {
+            FAM.clear(*F, F->getName());
+            RenewFunction(*F);
+        }
+        SortUseLists(M);
+        return PreservedAnalyses::none();
     }
   };
 }
 
 /**===================end of VectorizeMap========================/**/
+char ToleranceCheckPoints::ID = 0;
+static RegisterPass<ToleranceCheckPoints> Y("tolerance-checkpoints", "Tolerance CheckPoint Analysis",
+                             false /* Only looks at CFG */,
+                             true /* Analysis Pass */);
 char TolerancePass::ID = 0;
 static RegisterPass<TolerancePass> X("tolerance", "Tolerance Pass",
                              false /* Only looks at CFG */,
-                             false /* Analysis Pass */);
\ No newline at end of file
+                             false /* Analysis Pass */);
+char ToleranceFISites::ID = 0;
+static RegisterPass<ToleranceFISites> FI("tolerance-fi-sites", "Tolerance Fault Injection Sites",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
+char ToleranceInject::ID = 0;
+static RegisterPass<ToleranceInject> INJ("tolerance-inject", "Tolerance Fault Injection",
+                             false /* Only looks at CFG */,
+                             false /* Analysis Pass */);
+
+//Plugin entry for opt -load-pass-plugin and for LTO backends
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "Tolerance", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(
+                [](FunctionAnalysisManager &FAM) {
+                  FAM.registerPass([] { return ToleranceCheckPointAnalysis(); });
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, FunctionPassManager &FPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "tolerance") {
+                    FPM.addPass(ToleranceNewPass());
+                    return true;
+                  }
+                  if (Name == "print<tolerance-checkpoints>") {
+                    FPM.addPass(ToleranceCheckPointPrinter(errs()));
+                    return true;
+                  }
+                  if (Name == "tolerance-fi-sites") {
+                    FPM.addPass(ToleranceFISitesNewPass());
+                    return true;
+                  }
+                  if (Name == "tolerance-inject") {
+                    FPM.addPass(ToleranceInjectNewPass());
+                    return true;
+                  }
+                  return false;
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "tolerance-module") {
+                    MPM.addPass(ToleranceModulePass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Allocation count of the Tolerance pass against function size.
+
+Generates functions of a growing number of statements, each a load, a
+binop and a store to one of a few allocas, and runs opt on each with and
+without -tolerance under malloc_count.c. Per size, the report gives:
+
+  insts      instructions in the function
+  allocs     allocations opt makes with -tolerance beyond the plain run
+  per inst   the same per instruction, which stays flat while the pass is
+             linear in the function size
+  bytes      bytes asked for beyond the plain run, per instruction
+
+  allocs.py --plugin build/lib/libTolerancePass.so
+"""
+
+import argparse
+import os
+import subprocess
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SLOTS = 16
+
+
+def generate(path, size):
+    """One function of size load-add-store statements; returns its insts."""
+    lines = ['define i32 @chain(i32 %x) {', 'entry:']
+    for i in range(SLOTS):
+        lines.append('  %%s%d = alloca i32, align 4' % i)
+        lines.append('  store i32 %%x, i32* %%s%d, align 4' % i)
+    for i in range(size):
+        lines.append('  %%v%d = load i32, i32* %%s%d, align 4' % (i, i % SLOTS))
+        lines.append('  %%a%d = add nsw i32 %%v%d, %d' % (i, i, i + 1))
+        lines.append('  store i32 %%a%d, i32* %%s%d, align 4' % (i, (i + 1) % SLOTS))
+    lines.append('  %%r = load i32, i32* %%s%d, align 4' % (size % SLOTS))
+    lines.append('  ret i32 %r')
+    lines.append('}')
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+    return 2 * SLOTS + 3 * size + 2
+
+
+def count(args, shim, workdir, flags, ll):
+    """(calls, bytes) of one opt run."""
+    out = os.path.join(workdir, 'count')
+    env = dict(os.environ, LD_PRELOAD=shim, MALLOC_COUNT_FILE=out)
+    subprocess.run([args.opt, '-load', args.plugin] + flags + [ll, '-o', os.devnull],
+                   env=env, check=True)
+    with open(out) as f:
+        calls, size = f.read().split()
+    return int(calls), int(size)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--plugin', required=True, help='libTolerancePass.so')
+    parser.add_argument('--opt', default='opt')
+    parser.add_argument('--cc', default='cc')
+    parser.add_argument('--sizes', default='1000,2000,4000,8000,16000',
+                        help='statements per function')
+    parser.add_argument('--tolerance-flags', default='', help="extra opt flags, e.g. '-check-majority'")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory(prefix='tolerance-allocs.') as workdir:
+        shim = os.path.join(workdir, 'malloc_count.so')
+        subprocess.run([args.cc, '-shared', '-fPIC', '-O2', os.path.join(HERE, 'malloc_count.c'),
+                        '-o', shim], check=True)
+        print('%8s %10s %9s %9s' % ('insts', 'allocs', 'per inst', 'bytes'))
+        for size in map(int, args.sizes.split(',')):
+            ll = os.path.join(workdir, 'chain%d.ll' % size)
+            insts = generate(ll, size)
+            plain = count(args, shim, workdir, [], ll)
+            prot = count(args, shim, workdir, ['-tolerance'] + args.tolerance_flags.split(), ll)
+            allocs = prot[0] - plain[0]
+            print('%8d %10d %9.2f %9.1f' % (insts, allocs, float(allocs) / insts,
+                                             float(prot[1] - plain[1]) / insts))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+"""Fault-injection campaign for the Tolerance pass.
+
+Builds kernels.c five ways. clang optimizes the kernels first, then opt
+adds the protection and llc lowers the result without running the IR
+optimizer again, which could fold the checks away:
+
+  plain      unprotected
+  protected  -tolerance
+  plain-fi   unprotected, with fault injection
+  detect-fi  -tolerance in detect-only mode, with fault injection
+  recover-fi -tolerance, with fault injection
+
+For every run, a seed picks one dynamic result and one bit to flip. The
+same fault then hits each of the three fault-injection builds, and the
+outcomes are compared with a fault-free run. Runs are spread over all
+cores. Per kernel, the report gives:
+
+  detection  faults reported by the detect-only checks
+  recovery   faults that corrupt the unprotected output but leave the
+             recover build correct
+  SDC        runs that finish with a wrong output, per build
+  slowdown   protected vs. plain run time, without injection
+
+  campaign.py --plugin build/lib/libTolerancePass.so --runs 1000
+
+With --cost, nothing is injected. The kernels are built once per recovery
+and check scheme instead, and each build is compared with the plain one
+by run time per kernel and by the size of its code sections:
+
+  default    -tolerance, recovery by the x3 rule
+  majority   -tolerance -check-majority
+  cf         -tolerance -tolerance-control-flow
+
+  campaign.py --plugin build/lib/libTolerancePass.so --cost
+"""
+
+import argparse
+import concurrent.futures
+import os
+import random
+import re
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+RUNTIME = os.path.join(HERE, '..', 'runtime', 'tolerance_fi.c')
+KERNELS = ['int', 'float', 'double', 'sparse']
+REPORT_RE = re.compile(r'tolerance-fi: dynamic=(\d+) injected=(\d+) detected=(\d+)')
+COST_BUILDS = {
+    'default': [],
+    'majority': ['-check-majority'],
+    'cf': ['-tolerance-control-flow'],
+}
+
+
+def check_call(cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+
+def compile_kernels(args, workdir):
+    bc = os.path.join(workdir, 'kernels.bc')
+    # vector loops would go unchecked: the shadows are per scalar value
+    check_call([args.clang, '-O' + args.opt_level, '-fno-vectorize', '-fno-slp-vectorize',
+                '-emit-llvm', '-c', os.path.join(HERE, 'kernels.c'), '-o', bc])
+    return bc
+
+
+def lower(args, workdir, bc, name, flags):
+    """Protects bc with flags and links it; returns (binary, object)."""
+    out_bc = os.path.join(workdir, name + '.bc')
+    out_obj = os.path.join(workdir, name + '.o')
+    check_call([args.opt, '-load', args.plugin] + flags + [bc, '-o', out_bc])
+    check_call([args.llc, '-O' + args.opt_level, '-relocation-model=pic', '-filetype=obj',
+                out_bc, '-o', out_obj])
+    binary = os.path.join(workdir, name)
+    check_call([args.clang, '-O2', out_obj, RUNTIME, '-o', binary])
+    return binary, out_obj
+
+
+def text_size(obj):
+    """Bytes in the executable sections of an ELF64 object."""
+    with open(obj, 'rb') as f:
+        data = f.read()
+    shoff, = struct.unpack_from('<Q', data, 0x28)
+    shentsize, shnum = struct.unpack_from('<HH', data, 0x3a)
+    size = 0
+    for i in range(shnum):
+        flags, = struct.unpack_from('<Q', data, shoff + i * shentsize + 8)
+        if flags & 0x4:  # SHF_EXECINSTR
+            size += struct.unpack_from('<Q', data, shoff + i * shentsize + 32)[0]
+    return size
+
+
+def build(args, workdir):
+    """Returns build name -> binary path."""
+    bc = compile_kernels(args, workdir)
+    policy = os.path.join(workdir, 'detect.policy')
+    with open(policy, 'w') as f:
+        f.write('* detect\n')
+    tolerance = ['-tolerance'] + args.tolerance_flags.split()
+    passes = {
+        'plain': [],
+        'protected': tolerance,
+        'plain-fi': ['-tolerance-fi-sites', '-tolerance-inject'],
+        'detect-fi': ['-tolerance-fi-sites'] + tolerance +
+                     ['-tolerance-policy=' + policy, '-tolerance-inject'],
+        'recover-fi': ['-tolerance-fi-sites'] + tolerance + ['-tolerance-inject'],
+    }
+    bins = {}
+    for name, flags in passes.items():
+        bins[name], _ = lower(args, workdir, bc, name, flags)
+    return bins
+
+
+def cost(args, workdir):
+    """Slowdown and code size of each COST_BUILDS scheme against plain."""
+    bc = compile_kernels(args, workdir)
+    tolerance = ['-tolerance'] + args.tolerance_flags.split()
+    builds = {'plain': lower(args, workdir, bc, 'plain', [])}
+    for name, flags in COST_BUILDS.items():
+        builds[name] = lower(args, workdir, bc, name, tolerance + flags)
+    kernels = args.kernels.split(',')
+    print('%-9s %9s %7s' % ('build', '.text', 'growth') +
+          ''.join(' %9s' % kernel for kernel in kernels))
+    base = {kernel: time_binary(builds['plain'][0], kernel, args.size, args.repeat)
+            for kernel in kernels}
+    plain_text = text_size(builds['plain'][1])
+    for name, (binary, obj) in builds.items():
+        text = text_size(obj)
+        slowdown = [time_binary(binary, kernel, args.size, args.repeat) / base[kernel]
+                    for kernel in kernels]
+        print('%-9s %9d %6.2fx' % (name, text, float(text) / plain_text) +
+              ''.join(' %8.2fx' % x for x in slowdown))
+
+
+def run(binary, kernel, size, env=None, timeout=None):
+    """Returns (outcome, output, detected); outcome is ok, crash or hang."""
+    try:
+        proc = subprocess.run([binary, kernel, str(size)], env=env, timeout=timeout,
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                              universal_newlines=True)
+    except subprocess.TimeoutExpired:
+        return 'hang', None, 0
+    match = REPORT_RE.search(proc.stderr)
+    if proc.returncode != 0 or not match:
+        return 'crash', None, 0
+    return 'ok', proc.stdout, int(match.group(3))
+
+
+def time_binary(binary, kernel, size, repeat):
+    times = []
+    for _ in range(repeat):
+        start = time.perf_counter()
+        run(binary, kernel, size)
+        times.append(time.perf_counter() - start)
+    return statistics.median(times)
+
+
+def inject(bins, kernel, size, golden, dynamic, seed, timeout):
+    """One fault, the same in every fault-injection build."""
+    rng = random.Random(seed)
+    env = dict(os.environ, TOLERANCE_FI_TARGET=str(rng.randrange(dynamic)),
+               TOLERANCE_FI_BIT=str(rng.randrange(64)))
+    result = {}
+    for name in ('plain-fi', 'detect-fi', 'recover-fi'):
+        outcome, output, detected = run(bins[name], kernel, size, env, timeout)
+        if outcome == 'ok' and detected:
+            outcome = 'detected'
+        elif outcome == 'ok':
+            outcome = 'correct' if output == golden else 'sdc'
+        result[name] = outcome
+    return result
+
+
+def campaign(args, bins, kernel, pool):
+    outcome, golden, _ = run(bins['plain'], kernel, args.size)
+    if outcome != 'ok':
+        sys.exit('%s: fault-free run failed' % kernel)
+    base = time_binary(bins['plain'], kernel, args.size, args.repeat)
+    prot = time_binary(bins['protected'], kernel, args.size, args.repeat)
+    proc = subprocess.run([bins['plain-fi'], kernel, str(args.size)],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+    dynamic = int(REPORT_RE.search(proc.stderr).group(1))
+    timeout = max(1.0, 20 * prot)
+    jobs = [pool.submit(inject, bins, kernel, args.size, golden, dynamic,
+                        args.seed + i, timeout) for i in range(args.runs)]
+    results = [job.result() for job in jobs]
+
+    def rate(name, outcome):
+        return 100.0 * sum(r[name] == outcome for r in results) / len(results)
+    effective = [r for r in results if r['plain-fi'] == 'sdc']
+    recovered = sum(r['recover-fi'] == 'correct' for r in effective)
+    print('%-7s %10d %9.1f%% %9.1f%% %8.1f%% %8.1f%% %8.1f%% %8.2fx' % (
+        kernel, dynamic, rate('detect-fi', 'detected'),
+        100.0 * recovered / len(effective) if effective else 100.0,
+        rate('plain-fi', 'sdc'), rate('recover-fi', 'sdc'),
+        rate('recover-fi', 'crash') + rate('recover-fi', 'hang'), prot / base))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--plugin', required=True, help='libTolerancePass.so')
+    parser.add_argument('--clang', default='clang')
+    parser.add_argument('--opt', default='opt')
+    parser.add_argument('--llc', default='llc')
+    parser.add_argument('--opt-level', default='2',
+                        help='-O level of clang before and of llc after the protection')
+    parser.add_argument('--tolerance-flags', default='', help="extra opt flags, e.g. '-check-majority'")
+    parser.add_argument('--kernels', default=','.join(KERNELS))
+    parser.add_argument('--size', type=int, default=64)
+    parser.add_argument('--runs', type=int, default=1000, help='faults per kernel')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--repeat', type=int, default=5, help='timing runs per build')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count())
+    parser.add_argument('--cost', action='store_true',
+                        help='compare the run time and code size of the recovery and check schemes')
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory(prefix='tolerance-fi.') as workdir:
+        if args.cost:
+            cost(args, workdir)
+            return
+        bins = build(args, workdir)
+        print('%-7s %10s %10s %10s %9s %9s %9s %9s' % (
+            'kernel', 'results', 'detection', 'recovery', 'SDC', 'SDC prot',
+            'crash', 'slowdown'))
+        with concurrent.futures.ThreadPoolExecutor(args.jobs) as pool:
+            for kernel in args.kernels.split(','):
+                campaign(args, bins, kernel, pool)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,128 @@
+/* Kernels of the fault-injection campaign, see campaign.py.
+ *
+ *   kernels int|float|double|sparse [size]
+ *
+ * runs one integer, float, double or heap-indexed kernel and prints a checksum of its
+ * result, which the driver compares against a fault-free run. The data is
+ * generated, so the kernels need no input files. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX 256
+
+static int ia[MAX][MAX], ib[MAX][MAX], ic[MAX][MAX];
+static float fx[MAX * MAX], fy[MAX * MAX];
+static double da[MAX * MAX], db[MAX * MAX];
+
+/* integer matrix multiply */
+static long kernel_int(int n) {
+  int i, j, k;
+  long sum = 0;
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++) {
+      ia[i][j] = (i * 7 + j * 3) % 17;
+      ib[i][j] = (i * 5 + j * 11) % 13;
+    }
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++) {
+      int acc = 0;
+      for (k = 0; k < n; k++)
+        acc = acc + ia[i][k] * ib[k][j];
+      ic[i][j] = acc;
+    }
+  for (i = 0; i < n; i++)
+    for (j = 0; j < n; j++)
+      sum = sum + ic[i][j];
+  return sum;
+}
+
+/* repeated saxpy */
+static double kernel_float(int n) {
+  int i, r, len = n * n;
+  float a = 0.5f, sum = 0.0f;
+  for (i = 0; i < len; i++) {
+    fx[i] = (float)(i % 100) * 0.01f;
+    fy[i] = (float)(i % 37) * 0.1f;
+  }
+  for (r = 0; r < 8; r++)
+    for (i = 0; i < len; i++)
+      fy[i] = a * fx[i] + fy[i];
+  for (i = 0; i < len; i++)
+    sum = sum + fy[i];
+  return sum;
+}
+
+/* 1-D Jacobi stencil */
+static double kernel_double(int n) {
+  int i, r, len = n * n;
+  double sum = 0.0;
+  for (i = 0; i < len; i++)
+    da[i] = (double)(i % 91) / 91.0;
+  for (r = 0; r < 8; r++) {
+    for (i = 1; i < len - 1; i++)
+      db[i] = (da[i - 1] + da[i] + da[i + 1]) / 3.0;
+    for (i = 1; i < len - 1; i++)
+      da[i] = db[i];
+  }
+  for (i = 0; i < len; i++)
+    sum = sum + da[i];
+  return sum;
+}
+
+/* sparse matrix-vector product on the heap, indexed through the CSR
+ * column array */
+static double kernel_sparse(int n) {
+  int i, k, r, len = n * n, nnz = 3 * len;
+  int *row = malloc((len + 1) * sizeof(int)), *col = malloc(nnz * sizeof(int));
+  double *val = malloc(nnz * sizeof(double)), *x = malloc(len * sizeof(double));
+  double *y = malloc(len * sizeof(double)), sum = 0.0;
+  for (i = 0; i < len; i++) {
+    row[i] = 3 * i;
+    for (k = 0; k < 3; k++) {
+      col[3 * i + k] = (i * 13 + k * 7) % len;
+      val[3 * i + k] = (double)((i + k) % 29) / 29.0;
+    }
+    x[i] = (double)(i % 53) / 53.0;
+  }
+  row[len] = nnz;
+  for (r = 0; r < 8; r++) {
+    for (i = 0; i < len; i++) {
+      double acc = 0.0;
+      for (k = row[i]; k < row[i + 1]; k++)
+        acc = acc + val[k] * x[col[k]];
+      y[i] = acc;
+    }
+    for (i = 0; i < len; i++)
+      x[i] = y[i] * 0.5;
+  }
+  for (i = 0; i < len; i++)
+    sum = sum + x[i];
+  free(row);
+  free(col);
+  free(val);
+  free(x);
+  free(y);
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  int n = argc > 2 ? atoi(argv[2]) : 64;
+  if (argc < 2 || n < 2 || n > MAX) {
+    fprintf(stderr, "usage: %s int|float|double|sparse [size 2..%d]\n", argv[0], MAX);
+    return 2;
+  }
+  if (!strcmp(argv[1], "int"))
+    printf("%ld\n", kernel_int(n));
+  else if (!strcmp(argv[1], "float"))
+    printf("%.9g\n", kernel_float(n));
+  else if (!strcmp(argv[1], "double"))
+    printf("%.17g\n", kernel_double(n));
+  else if (!strcmp(argv[1], "sparse"))
+    printf("%.17g\n", kernel_sparse(n));
+  else {
+    fprintf(stderr, "unknown kernel %s\n", argv[1]);
+    return 2;
+  }
+  return 0;
+}
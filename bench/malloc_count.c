@@ -0,0 +1,46 @@
+/* Allocation counter for allocs.py, preloaded into opt:
+ *
+ *   cc -shared -fPIC -O2 malloc_count.c -o malloc_count.so
+ *   LD_PRELOAD=./malloc_count.so MALLOC_COUNT_FILE=out opt ...
+ *
+ * counts the calls of malloc, calloc and realloc and the bytes asked for,
+ * and writes "<calls> <bytes>" to MALLOC_COUNT_FILE at exit. operator new
+ * goes through malloc, so LLVM's own containers are counted too. */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static unsigned long calls, bytes;
+
+static void count(size_t size) {
+  __atomic_add_fetch(&calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+  count(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  count(n * size);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  count(size);
+  return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor)) static void report(void) {
+  const char *path = getenv("MALLOC_COUNT_FILE");
+  FILE *out;
+  if (!path || !(out = fopen(path, "w")))
+    return;
+  fprintf(out, "%lu %lu\n", calls, bytes);
+  fclose(out);
+}
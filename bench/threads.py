@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+"""Scaling of -passes=tolerance-module with -tolerance-threads.
+
+Protects one module with 1 to --max-threads threads and compares every
+output with the serial one. The module is --input, or else one generated
+with --funcs functions of --size load-add-store statements each. Per
+thread count, the report gives:
+
+  threads    -tolerance-threads
+  seconds    best wall time of --repeat opt runs
+  speedup    serial time over this time
+  same       whether the output bitcode is the serial output, byte by byte
+
+  threads.py --plugin build/lib/libTolerancePass.so
+"""
+
+import argparse
+import filecmp
+import os
+import subprocess
+import tempfile
+import time
+
+SLOTS = 16
+
+
+def generate(path, funcs, size):
+    """funcs functions of size load-add-store statements each."""
+    lines = []
+    for f in range(funcs):
+        lines.append('define i32 @chain%d(i32 %%x) {' % f)
+        lines.append('entry:')
+        for i in range(SLOTS):
+            lines.append('  %%s%d = alloca i32, align 4' % i)
+            lines.append('  store i32 %%x, i32* %%s%d, align 4' % i)
+        for i in range(size):
+            lines.append('  %%v%d = load i32, i32* %%s%d, align 4' % (i, i % SLOTS))
+            lines.append('  %%a%d = add nsw i32 %%v%d, %d' % (i, i, f + i + 1))
+            lines.append('  store i32 %%a%d, i32* %%s%d, align 4' % (i, (i + 1) % SLOTS))
+        lines.append('  %%r = load i32, i32* %%s%d, align 4' % (size % SLOTS))
+        lines.append('  ret i32 %r')
+        lines.append('}')
+        lines.append('')
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines))
+
+
+def protect(args, module, threads, out):
+    """Best wall time of --repeat runs."""
+    cmd = [args.opt, '-load', args.plugin, '-load-pass-plugin', args.plugin, '-passes=tolerance-module',
+           '-tolerance-threads=%d' % threads] + args.tolerance_flags.split() + [module, '-o', out]
+    best = None
+    for _ in range(args.repeat):
+        start = time.time()
+        subprocess.run(cmd, check=True)
+        elapsed = time.time() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--plugin', required=True, help='libTolerancePass.so')
+    parser.add_argument('--opt', default='opt')
+    parser.add_argument('--input', help='module to protect instead of a generated one')
+    parser.add_argument('--funcs', type=int, default=64, help='functions of the generated module')
+    parser.add_argument('--size', type=int, default=500, help='statements per generated function')
+    parser.add_argument('--max-threads', type=int, default=os.cpu_count())
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--tolerance-flags', default='', help="extra opt flags, e.g. '-tolerance-control-flow'")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory(prefix='tolerance-threads.') as workdir:
+        module = args.input
+        if not module:
+            module = os.path.join(workdir, 'chains.ll')
+            generate(module, args.funcs, args.size)
+        serial = os.path.join(workdir, 'out1.bc')
+        base = protect(args, module, 1, serial)
+        print('%8s %9s %8s %5s' % ('threads', 'seconds', 'speedup', 'same'))
+        print('%8d %9.3f %8.2f %5s' % (1, base, 1.0, 'yes'))
+        for threads in range(2, args.max_threads + 1):
+            out = os.path.join(workdir, 'out%d.bc' % threads)
+            seconds = protect(args, module, threads, out)
+            same = filecmp.cmp(serial, out, shallow=False)
+            print('%8d %9.3f %8.2f %5s' % (threads, seconds, base / seconds, 'yes' if same else 'NO'))
+
+
+if __name__ == '__main__':
+    main()
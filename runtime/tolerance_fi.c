@@ -0,0 +1,49 @@
+/* Runtime of the fault-injection campaign, see bench/campaign.py.
+ *
+ * Programs built with -tolerance-inject call __tolerance_inject on every
+ * tagged dynamic result. TOLERANCE_FI_TARGET picks the result to hit,
+ * counting from 0, and TOLERANCE_FI_BIT the bit to flip in it, modulo the
+ * result width. Without TOLERANCE_FI_TARGET nothing is flipped and the run
+ * only counts the results. Checks built in detect-only mode report to
+ * __tolerance_fault, which returns so the run goes on.
+ *
+ * At exit one line goes to stderr for the driver:
+ *   tolerance-fi: dynamic=<results> injected=<0|1> detected=<faults>
+ *
+ * The kernels are single threaded, so the counters are plain globals. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t dynamic;
+static uint64_t target = UINT64_MAX;
+static unsigned bit;
+static unsigned injected, detected;
+
+__attribute__((constructor)) static void fi_init(void) {
+  const char *env = getenv("TOLERANCE_FI_TARGET");
+  if (env)
+    target = strtoull(env, NULL, 10);
+  env = getenv("TOLERANCE_FI_BIT");
+  if (env)
+    bit = strtoul(env, NULL, 10);
+}
+
+__attribute__((destructor)) static void fi_report(void) {
+  fprintf(stderr, "tolerance-fi: dynamic=%llu injected=%u detected=%u\n",
+          (unsigned long long)dynamic, injected, detected);
+}
+
+uint64_t __tolerance_inject(uint64_t bits, uint32_t width) {
+  if (dynamic++ == target) {
+    bits ^= 1ull << (bit % width);
+    injected = 1;
+  }
+  return bits;
+}
+
+void __tolerance_fault(const char *function, int site) {
+  (void)function;
+  (void)site;
+  detected++;
+}
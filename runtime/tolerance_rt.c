@@ -0,0 +1,224 @@
+/* Runtime fault counters for code built with -tolerance-fault-counters,
+ * and the default fault hook of detect-only checks.
+ *
+ * The cold path of every check calls __tolerance_count with a descriptor
+ * of the check; the fault-free path never reaches the runtime. Each thread
+ * counts into its own cache-line aligned block, written only by that
+ * thread, so counting takes no lock and threads never share a line. Blocks
+ * outlive their threads, so no count is lost.
+ *
+ * The counters of all threads are summed and dumped at exit and whenever
+ * the process gets SIGUSR2, one line per site that saw a fault:
+ *   tolerance: <file>:<line>:<column> <function> check <site>: <n> faults
+ * Environment:
+ *   TOLERANCE_COUNTERS_FILE    append the dump there instead of stderr
+ *   TOLERANCE_COUNTERS_SIGNAL  dump signal number, 0 for none
+ *
+ * Detect-only checks call __tolerance_fault. The weak default here reports
+ * the fault on stderr and aborts; a program may define its own hook to log
+ * and go on, or to restart.
+ *
+ * Link with -pthread if threads use it. */
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_SITES 4096
+#define CACHE_LINE 64
+#define SITE_BUSY -1
+#define SITE_OVERFLOW -2
+
+/* Layout emitted by the pass; id is 0 until the site is registered,
+ * SITE_BUSY while it is being registered, then its index + 1, or
+ * SITE_OVERFLOW for good if the table was full. */
+struct tolerance_site {
+  _Atomic int32_t id;
+  uint32_t line, column;
+  int32_t site;
+  const char *function, *file;
+};
+
+struct thread_counters {
+  _Atomic uint64_t count[MAX_SITES];
+  struct thread_counters *next;
+};
+
+static struct tolerance_site *_Atomic sites[MAX_SITES];
+static _Atomic uint32_t nsites;
+static _Atomic uint64_t overflow;
+static struct thread_counters *_Atomic threads;
+static _Thread_local struct thread_counters *counters;
+static const char *dump_path;
+
+static int32_t register_site(struct tolerance_site *site) {
+  int32_t id = 0;
+  if (atomic_compare_exchange_strong(&site->id, &id, SITE_BUSY)) {
+    /* claim a slot only while one is left, so nsites stops at MAX_SITES */
+    uint32_t index = atomic_load(&nsites);
+    do {
+      if (index >= MAX_SITES) {
+        atomic_store(&site->id, SITE_OVERFLOW);
+        return SITE_OVERFLOW;
+      }
+    } while (!atomic_compare_exchange_weak(&nsites, &index, index + 1));
+    atomic_store(&sites[index], site);
+    atomic_store(&site->id, index + 1);
+    return index + 1;
+  }
+  /* another thread is registering it */
+  while ((id = atomic_load(&site->id)) == SITE_BUSY)
+    ;
+  return id;
+}
+
+static struct thread_counters *thread_block(void) {
+  /* aligned_alloc wants a multiple of the alignment */
+  size_t size = (sizeof(struct thread_counters) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  struct thread_counters *block = aligned_alloc(CACHE_LINE, size);
+  if (!block)
+    return NULL;
+  memset(block, 0, size);
+  block->next = atomic_load(&threads);
+  while (!atomic_compare_exchange_weak(&threads, &block->next, block))
+    ;
+  return block;
+}
+
+void __tolerance_count(struct tolerance_site *site) {
+  if (!site)
+    return;
+  int32_t id = atomic_load_explicit(&site->id, memory_order_acquire);
+  if (id == 0 || id == SITE_BUSY)
+    id = register_site(site);
+  if (!counters)
+    counters = thread_block();
+  if (id <= 0 || !counters) {
+    atomic_fetch_add_explicit(&overflow, 1, memory_order_relaxed);
+    return;
+  }
+  /* only this thread writes its block: no locked add needed */
+  _Atomic uint64_t *count = &counters->count[id - 1];
+  atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+
+/* The dump runs in signal handlers too, so it formats by hand and only
+ * uses write(). */
+struct out {
+  char buf[512];
+  size_t len;
+  int fd;
+};
+
+static void flush(struct out *o) {
+  size_t done = 0;
+  while (done < o->len) {
+    ssize_t n = write(o->fd, o->buf + done, o->len - done);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  o->len = 0;
+}
+
+static void put_str(struct out *o, const char *s) {
+  for (; s && *s; s++) {
+    if (o->len == sizeof(o->buf))
+      flush(o);
+    o->buf[o->len++] = *s;
+  }
+}
+
+static void put_num(struct out *o, long long n) {
+  char digits[24];
+  int i = sizeof(digits) - 1;
+  int neg = n < 0;
+  unsigned long long u = neg ? -(unsigned long long)n : (unsigned long long)n;
+  digits[i] = 0;
+  do {
+    digits[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (neg)
+    digits[--i] = '-';
+  put_str(o, digits + i);
+}
+
+static void dump(void) {
+  struct out o;
+  o.len = 0;
+  o.fd = dump_path ? open(dump_path, O_WRONLY | O_CREAT | O_APPEND, 0644) : 2;
+  if (o.fd < 0)
+    return;
+  uint32_t n = atomic_load(&nsites);
+  for (uint32_t i = 0; i < n; i++) {
+    struct tolerance_site *site = atomic_load(&sites[i]);
+    uint64_t total = 0;
+    if (!site)
+      continue;
+    for (struct thread_counters *t = atomic_load(&threads); t; t = t->next)
+      total += atomic_load_explicit(&t->count[i], memory_order_relaxed);
+    if (!total)
+      continue;
+    put_str(&o, "tolerance: ");
+    put_str(&o, site->file && *site->file ? site->file : "<unknown>");
+    put_str(&o, ":");
+    put_num(&o, site->line);
+    put_str(&o, ":");
+    put_num(&o, site->column);
+    put_str(&o, " ");
+    put_str(&o, site->function);
+    put_str(&o, " check ");
+    put_num(&o, site->site);
+    put_str(&o, ": ");
+    put_num(&o, total);
+    put_str(&o, " faults\n");
+  }
+  uint64_t lost = atomic_load(&overflow);
+  if (lost) {
+    put_str(&o, "tolerance: ");
+    put_num(&o, lost);
+    put_str(&o, " faults at sites past the counter table\n");
+  }
+  flush(&o);
+  if (dump_path)
+    close(o.fd);
+}
+
+__attribute__((weak)) void __tolerance_fault(const char *function, int site) {
+  struct out o;
+  o.len = 0;
+  o.fd = 2;
+  put_str(&o, "tolerance: fault detected in ");
+  put_str(&o, function);
+  put_str(&o, " check ");
+  put_num(&o, site);
+  put_str(&o, "\n");
+  flush(&o);
+  abort();
+}
+
+static void dump_on_signal(int sig) {
+  (void)sig;
+  dump();
+}
+
+__attribute__((constructor)) static void counters_init(void) {
+  const char *env = getenv("TOLERANCE_COUNTERS_SIGNAL");
+  int sig = env ? atoi(env) : SIGUSR2;
+  dump_path = getenv("TOLERANCE_COUNTERS_FILE");
+  atexit(dump);
+  if (sig > 0) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dump_on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+  }
+}
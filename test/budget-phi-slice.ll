@@ -0,0 +1,27 @@
+; RUN: opt -load %plugin -tolerance -tolerance-budget=100 -S %s | FileCheck %s
+
+; Under a budget only the slices of the selected checks are shadowed. The
+; returned sum reaches back through the loop PHIs of %s and %i, so both are
+; in its slice and get shadow PHIs.
+
+define i32 @sum_to(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %s.next = add nsw i32 %s, %i
+  %i.next = add nsw i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+
+exit:
+  ret i32 %s.next
+}
+
+; CHECK-LABEL: define i32 @sum_to(
+; CHECK: loop:
+; CHECK: = phi <{{[0-9]+}} x i32>
+; CHECK: = phi <{{[0-9]+}} x i32>
+; CHECK: ret i32
@@ -0,0 +1,18 @@
+; RUN: echo '* cf' > %t.policy
+; RUN: opt -load %plugin -tolerance -check-TRUMP -tolerance-policy=%t.policy -S %s | FileCheck %s
+
+; The returned sum gets an AN check, whose compare decides a branch and
+; has an operand with a shadow. Only compares of the original code are
+; checked again, so the AN check gets no second, compare check.
+
+define i32 @sum(i32 %a, i32 %b) {
+entry:
+  %s = add nsw i32 %a, %b
+  ret i32 %s
+}
+
+; CHECK-LABEL: define i32 @sum(
+; CHECK: %Fcmp = icmp ne i32
+; CHECK-NOT: validAN
+; CHECK-NOT: Vcmp
+; CHECK: ret i32
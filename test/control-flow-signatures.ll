@@ -0,0 +1,74 @@
+; RUN: echo '* cf' > %t.policy
+; RUN: opt -load %plugin -tolerance -tolerance-policy=%t.policy -S %s | FileCheck %s
+
+; Block signatures are multiples of 0x9E3779B1, numbered in reverse post
+; order. Each checked block accepts the signatures of its predecessors as
+; they were before any block was split for a check.
+
+declare i1 @more()
+declare void @work()
+
+; RPO entry, else, then, join: signatures 1, 2, 3 and 4 times 0x9E3779B1.
+define void @diamond(i1 %c) {
+entry:
+  br i1 %c, label %then, label %else
+
+then:
+  call void @work()
+  br label %join
+
+else:
+  call void @work()
+  br label %join
+
+join:
+  ret void
+}
+
+; CHECK-LABEL: define void @diamond(
+; CHECK: %cfSig = alloca i32
+; CHECK-NEXT: store volatile i32 -1640531535, i32* %cfSig
+; CHECK: [[CUR:%curSig[0-9]*]] = load volatile i32, i32* %cfSig
+; CHECK-NEXT: icmp ne i32 [[CUR]], -1640531535
+; CHECK: store volatile i32 -626627309, i32* %cfSig
+; CHECK: [[CUR:%curSig[0-9]*]] = load volatile i32, i32* %cfSig
+; CHECK-NEXT: icmp ne i32 [[CUR]], -1640531535
+; CHECK: store volatile i32 1013904226, i32* %cfSig
+; CHECK: [[CUR:%curSig[0-9]*]] = load volatile i32, i32* %cfSig
+; CHECK-NEXT: icmp ne i32 [[CUR]], 1013904226
+; CHECK: icmp ne i32 [[CUR]], -626627309
+; CHECK: store volatile i32 2027808452, i32* %cfSig
+; CHECK: ret void
+
+; RPO entry, header, exit, body. The header is split for its own check
+; before body is visited; body must still accept the header's signature.
+define void @loop() {
+entry:
+  br label %header
+
+header:
+  %m = call i1 @more()
+  br i1 %m, label %body, label %exit
+
+body:
+  call void @work()
+  br label %header
+
+exit:
+  ret void
+}
+
+; CHECK-LABEL: define void @loop(
+; CHECK: %cfSig = alloca i32
+; CHECK-NEXT: store volatile i32 -1640531535, i32* %cfSig
+; CHECK: [[CUR:%curSig[0-9]*]] = load volatile i32, i32* %cfSig
+; CHECK-NEXT: icmp ne i32 [[CUR]], 2027808452
+; CHECK: icmp ne i32 [[CUR]], -1640531535
+; CHECK: store volatile i32 1013904226, i32* %cfSig
+; CHECK: [[CUR:%curSig[0-9]*]] = load volatile i32, i32* %cfSig
+; CHECK-NEXT: icmp ne i32 [[CUR]], 1013904226
+; CHECK: store volatile i32 2027808452, i32* %cfSig
+; CHECK: [[CUR:%curSig[0-9]*]] = load volatile i32, i32* %cfSig
+; CHECK-NEXT: icmp ne i32 [[CUR]], 1013904226
+; CHECK: store volatile i32 -626627309, i32* %cfSig
+; CHECK: ret void
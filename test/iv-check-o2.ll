@@ -0,0 +1,51 @@
+; RUN: opt -load %plugin -tolerance -tolerance-loop-aware %s | opt -O2 -S | FileCheck %s
+
+; The step of i in
+;   for (i = 0; i < n; i++) a[i] = i;
+; is checked by recomputation. The recomputed step must stay an add of its
+; own, compared against i + 1, after -O2 has cleaned up the protected code.
+; A mismatch votes with a third computation, so the recovery cannot fold
+; into the recomputed step either.
+
+define void @fill(i32* %a, i32 %n) {
+entry:
+  %a.addr = alloca i32*, align 8
+  %n.addr = alloca i32, align 4
+  %i = alloca i32, align 4
+  store i32* %a, i32** %a.addr, align 8
+  store i32 %n, i32* %n.addr, align 4
+  store i32 0, i32* %i, align 4
+  br label %for.cond
+
+for.cond:
+  %0 = load i32, i32* %i, align 4
+  %1 = load i32, i32* %n.addr, align 4
+  %cmp = icmp slt i32 %0, %1
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %2 = load i32, i32* %i, align 4
+  %3 = load i32*, i32** %a.addr, align 8
+  %4 = load i32, i32* %i, align 4
+  %idxprom = sext i32 %4 to i64
+  %arrayidx = getelementptr inbounds i32, i32* %3, i64 %idxprom
+  store i32 %2, i32* %arrayidx, align 4
+  br label %for.inc
+
+for.inc:
+  %5 = load i32, i32* %i, align 4
+  %inc = add nsw i32 %5, 1
+  store i32 %inc, i32* %i, align 4
+  br label %for.cond
+
+for.end:
+  ret void
+}
+
+; CHECK-LABEL: define void @fill(
+; CHECK: [[COPY:%[^ ]+]] = {{.*}}call i32 asm "", "=r,0"(i32
+; CHECK: [[STEP:%[^ ]+]] = add {{.*}}i32 [[COPY]], 1
+; CHECK: [[RESULT:%[^ ]+]] = {{.*}}call i32 asm "", "=r,0"(i32 [[STEP]])
+; CHECK: icmp {{eq|ne}} i32 {{.*}}[[RESULT]]
+; CHECK: {{.*}}call i32 asm "", "=r,0"(i32
+; CHECK: select i1 {{.*}}, i32 [[RESULT]]
@@ -0,0 +1,16 @@
+# lit configuration of the Tolerance pass tests.
+#
+#   llvm-lit -Dplugin=<build>/lib/libTolerancePass.so test
+#
+# opt and FileCheck of the LLVM the plugin was built against must be on
+# PATH.
+import os
+
+import lit.formats
+
+config.name = 'Tolerance'
+config.test_format = lit.formats.ShTest(True)
+config.suffixes = ['.ll']
+config.test_source_root = os.path.dirname(__file__)
+config.environment['PATH'] = os.environ.get('PATH', '')
+config.substitutions.append(('%plugin', lit_config.params.get('plugin', 'libTolerancePass.so')))
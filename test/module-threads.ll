@@ -0,0 +1,81 @@
+; RUN: opt -load %plugin -load-pass-plugin %plugin -passes=tolerance-module -tolerance-clone-budget=100 -tolerance-control-flow -tolerance-threads=1 -S %s -o %t.1
+; RUN: opt -load %plugin -load-pass-plugin %plugin -passes=tolerance-module -tolerance-clone-budget=100 -tolerance-control-flow -tolerance-threads=3 -S %s -o %t.3
+; RUN: diff %t.1 %t.3
+; RUN: FileCheck %s < %t.3
+
+; Protecting in parts must give the output of protecting function by
+; function. The functions land in three parts, which share an unnamed
+; private string, internal globals, a local helper and its clone, and a
+; distinct loop node, which must stay one node.
+
+; CHECK: module asm "nop"
+; CHECK: @0 = private unnamed_addr constant
+; CHECK-NEXT: @g = internal global i32 7
+; CHECK-NEXT: @1 = internal global i32 3
+; CHECK: define internal i32 @helper(
+; CHECK: define i32 @2(
+; CHECK: define i32 @entry(
+; CHECK: br i1 {{.*}}, !llvm.loop [[LOOP:![0-9]+]]
+; CHECK: define i32 @other(
+; CHECK: br i1 {{.*}}, !llvm.loop [[LOOP]]
+; CHECK: define internal i32 @helper.shadow(
+; CHECK: [[LOOP]] = distinct !{[[LOOP]],
+
+module asm "nop"
+
+@0 = private unnamed_addr constant [4 x i8] c"abc\00"
+@g = internal global i32 7
+@1 = internal global i32 3
+
+define internal i32 @helper(i32 %a, i32 %b) {
+  %s = add i32 %a, %b
+  %m = mul i32 %s, %a
+  %p = getelementptr [4 x i8], [4 x i8]* @0, i64 0, i64 0
+  store i32 %m, i32* @g
+  ret i32 %m
+}
+
+define i32 @2(i32 %x) {
+  %v = load i32, i32* @1
+  %y = add i32 %x, %v
+  %z = call i32 @helper(i32 %y, i32 %x)
+  store i32 %z, i32* @1
+  ret i32 %z
+}
+
+define i32 @entry(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i2, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %acc2, %loop ]
+  %q = getelementptr i32, i32* %p, i32 %i
+  %l = load i32, i32* %q
+  %t = call i32 @2(i32 %l)
+  %acc2 = add i32 %acc, %t
+  store i32 %acc2, i32* %q
+  %i2 = add i32 %i, 1
+  %c = icmp slt i32 %i2, %n
+  br i1 %c, label %loop, label %exit, !llvm.loop !0
+exit:
+  ret i32 %acc2
+}
+
+define i32 @other(i32* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i2, %loop ]
+  %q = getelementptr i32, i32* %p, i32 %i
+  %l = load i32, i32* %q
+  %l2 = mul i32 %l, 3
+  store i32 %l2, i32* %q
+  %i2 = add i32 %i, 1
+  %c = icmp slt i32 %i2, %n
+  br i1 %c, label %loop, label %exit, !llvm.loop !0
+exit:
+  ret i32 %l2
+}
+
+!0 = distinct !{!0, !1}
+!1 = !{!"llvm.loop.mustprogress"}
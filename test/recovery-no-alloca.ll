@@ -0,0 +1,21 @@
+; RUN: opt -load %plugin -tolerance -S %s | FileCheck %s
+
+; a[i] = x + y stores through a GEP, so the store is a checkpoint though the
+; function has no alloca. It needs no recovery slot: the recovered value
+; meets the sum in a PHI in front of the store.
+
+define void @store_sum(i32* %a, i64 %i, i32 %x, i32 %y) {
+entry:
+  %sum = add nsw i32 %x, %y
+  %p = getelementptr inbounds i32, i32* %a, i64 %i
+  store i32 %sum, i32* %p, align 4
+  ret void
+}
+
+; CHECK-LABEL: define void @store_sum(
+; CHECK-NOT: alloca
+; CHECK: %sum = add nsw i32 %x, %y
+; CHECK: br i1
+; CHECK: [[REC:%Recovered[0-9]*]] = phi i32 [ %sum,
+; CHECK-NEXT: store i32 [[REC]], i32* %p
+; CHECK: ret void
@@ -0,0 +1,37 @@
+; RUN: opt -load %plugin -load-pass-plugin %plugin -passes=tolerance-module -tolerance-clone-budget=100 -S %s | FileCheck %s
+
+; The clone of load_local returns a local that was last written with a
+; loaded value, not a binop result, so the local's shadow slot was never
+; written. The returned shadow must be a splat of the returned scalar.
+
+define internal i32 @load_local(i32* %p) {
+entry:
+  %p.addr = alloca i32*, align 8
+  %r = alloca i32, align 4
+  store i32* %p, i32** %p.addr, align 8
+  %0 = load i32*, i32** %p.addr, align 8
+  %1 = load i32, i32* %0, align 4
+  store i32 %1, i32* %r, align 4
+  %2 = load i32, i32* %r, align 4
+  ret i32 %2
+}
+
+define i32 @caller(i32* %p, i32 %x) {
+entry:
+  %c = call i32 @load_local(i32* %p)
+  %s = add nsw i32 %c, %x
+  ret i32 %s
+}
+
+; The clone is appended to the module, after its caller.
+; CHECK-LABEL: define i32 @caller(
+; CHECK: call i32 @load_local.shadow(
+
+; CHECK-LABEL: define internal i32 @load_local.shadow(
+; CHECK-NOT: load <{{[0-9]+}} x i32>
+; CHECK: [[RET:%[0-9]+]] = load i32, i32* %r
+; CHECK-NOT: load <{{[0-9]+}} x i32>
+; CHECK: %insertRet.splatinsert = insertelement <{{[0-9]+}} x i32> {{undef|poison}}, i32 [[RET]], i32 0
+; CHECK: %insertRet.splat = shufflevector
+; CHECK-NEXT: store <{{[0-9]+}} x i32> %insertRet.splat, <{{[0-9]+}} x i32>* %ret.shadow
+; CHECK-NEXT: ret i32 [[RET]]